@@ -0,0 +1,147 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_BASELINE_QUEUE_H
+#define OBS_SSP_BASELINE_QUEUE_H
+#include <util/platform.h>
+#include <util/threading.h>
+#include <atomic>
+#include <functional>
+#include <QQueue>
+#include <QAtomicInt>
+#include <QSemaphore>
+#include <QMutex>
+#include <imf/ISspClient.h>
+#include "pthread.h"
+
+/*
+ * The decode queue as it was before the SPSC ring: a QQueue behind a QMutex,
+ * a QSemaphore per frame and a decode thread per source, malloc and free for
+ * every frame. enqueue and run are kept as they were so ssp-queue-bench can
+ * put the two side by side. Only differences: late frames are counted
+ * instead of going to qDebug, and stop frees what was never decoded.
+ */
+class BaselineVFrameQueue {
+	struct Frame {
+		imf::SspH264Data data;
+		uint64_t time;
+		bool noDrop;
+	};
+	typedef std::function<void(imf::SspH264Data *)> CallbackFunc;
+
+public:
+	void enqueue(imf::SspH264Data data, uint64_t time_us, bool noDrop)
+	{
+		QMutexLocker locker(&queueLock);
+		uint8_t *copy_data = (uint8_t *)malloc(data.len);
+		memcpy(copy_data, data.data, data.len);
+		data.data = copy_data;
+		frameQueue.enqueue({data, time_us, noDrop});
+		sem.release();
+	}
+	void setFrameCallback(CallbackFunc cb) { callback = std::move(cb); }
+	void start()
+	{
+		running = true;
+		pthread_create(&thread, nullptr, pthread_run, (void *)this);
+	}
+	void stop()
+	{
+		running = false;
+		sem.release();
+		pthread_join(thread, nullptr);
+		QMutexLocker locker(&queueLock);
+		while (!frameQueue.empty()) {
+			free((void *)frameQueue.dequeue().data.data);
+		}
+	}
+	uint32_t depth()
+	{
+		QMutexLocker locker(&queueLock);
+		return (uint32_t)frameQueue.size();
+	}
+	uint64_t dropped() { return droppedFrames; }
+
+private:
+	static void *pthread_run(void *q)
+	{
+		os_set_thread_name("baseline-decode");
+		run((BaselineVFrameQueue *)q);
+		return nullptr;
+	}
+	static void run(BaselineVFrameQueue *q)
+	{
+		Frame current;
+		uint64_t lastFrameTime = 0, lastStartTime = 0,
+			 processingTime = 0;
+		q->sem.acquire();
+		q->queueLock.lock();
+		if (q->frameQueue.empty()) {
+			q->queueLock.unlock();
+			return;
+		}
+		current = q->frameQueue.dequeue();
+		q->queueLock.unlock();
+		lastStartTime = os_gettime_ns() / 1000;
+		q->callback(&current.data);
+		lastFrameTime = current.time;
+		processingTime = os_gettime_ns() / 1000 - lastStartTime;
+		free((void *)current.data.data);
+		while (q->running) {
+			q->sem.acquire();
+			q->queueLock.lock();
+			if (q->frameQueue.empty()) {
+				q->queueLock.unlock();
+				continue;
+			}
+			current = q->frameQueue.dequeue();
+			q->queueLock.unlock();
+			if (current.time < lastFrameTime) {
+				q->droppedFrames++;
+				free((void *)current.data.data);
+				continue;
+			}
+			if (current.noDrop) {
+				lastStartTime = os_gettime_ns() / 1000;
+				q->callback(&current.data);
+				lastFrameTime = current.time;
+				processingTime =
+					os_gettime_ns() / 1000 - lastStartTime;
+			} else if (current.time - lastFrameTime + 15000 >
+				   processingTime) {
+				lastStartTime = os_gettime_ns() / 1000;
+				q->callback(&current.data);
+				lastFrameTime = current.time;
+				processingTime =
+					os_gettime_ns() / 1000 - lastStartTime;
+			} else {
+				q->droppedFrames++;
+			} // else we drop the frame
+			free((void *)current.data.data);
+		}
+	}
+	CallbackFunc callback;
+	QQueue<Frame> frameQueue;
+	QSemaphore sem;
+	QMutex queueLock;
+	pthread_t thread;
+	QAtomicInt running;
+	std::atomic<uint64_t> droppedFrames{0};
+};
+
+#endif //OBS_SSP_BASELINE_QUEUE_H
@@ -0,0 +1,192 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_BENCH_UTIL_H
+#define OBS_SSP_BENCH_UTIL_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <dirent.h>
+#endif
+
+/*
+ * What the benchmarks measure besides their own timings: CPU time and
+ * context switches, of the whole process and, on Linux, of every thread.
+ * Samples are taken before and after a run, only the difference is shown.
+ * Threads that ended in between only count in the process line.
+ */
+
+struct BenchUsage {
+	uint64_t cpu_ns;
+	uint64_t voluntary;   // context switches waiting for something
+	uint64_t involuntary; // preempted
+};
+
+struct BenchThread {
+	std::string name;
+	BenchUsage usage;
+};
+
+static inline uint64_t bench_timeval_ns(const struct timeval &tv)
+{
+	return (uint64_t)tv.tv_sec * 1000000000ULL +
+	       (uint64_t)tv.tv_usec * 1000ULL;
+}
+
+static inline BenchUsage bench_process_usage()
+{
+	struct rusage ru = {};
+	getrusage(RUSAGE_SELF, &ru);
+	return {bench_timeval_ns(ru.ru_utime) + bench_timeval_ns(ru.ru_stime),
+		(uint64_t)ru.ru_nvcsw, (uint64_t)ru.ru_nivcsw};
+}
+
+// By thread id. Empty where the system does not tell.
+static inline std::map<int, BenchThread> bench_threads()
+{
+	std::map<int, BenchThread> threads;
+#ifdef __linux__
+	DIR *dir = opendir("/proc/self/task");
+	if (!dir) {
+		return threads;
+	}
+	long ticks = sysconf(_SC_CLK_TCK);
+	while (struct dirent *e = readdir(dir)) {
+		int tid = atoi(e->d_name);
+		if (tid <= 0) {
+			continue;
+		}
+		char path[64];
+		char line[256];
+		BenchThread t = {};
+		snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+		if (FILE *f = fopen(path, "r")) {
+			if (fgets(line, sizeof(line), f)) {
+				line[strcspn(line, "\n")] = 0;
+				t.name = line;
+			}
+			fclose(f);
+		}
+		// utime and stime are fields 14 and 15, after the ")" of comm
+		snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+		if (FILE *f = fopen(path, "r")) {
+			char stat[1024];
+			size_t n = fread(stat, 1, sizeof(stat) - 1, f);
+			stat[n] = 0;
+			const char *p = strrchr(stat, ')');
+			unsigned long long utime = 0, stime = 0;
+			if (p && ticks > 0 &&
+			    sscanf(p + 1,
+				   " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+				   "%*u %llu %llu",
+				   &utime, &stime) == 2) {
+				t.usage.cpu_ns = (utime + stime) *
+						 (1000000000ULL / ticks);
+			}
+			fclose(f);
+		}
+		snprintf(path, sizeof(path), "/proc/self/task/%d/status",
+			 tid);
+		if (FILE *f = fopen(path, "r")) {
+			unsigned long long v;
+			while (fgets(line, sizeof(line), f)) {
+				if (sscanf(line,
+					   "voluntary_ctxt_switches: %llu",
+					   &v) == 1) {
+					t.usage.voluntary = v;
+				} else if (sscanf(line,
+						  "nonvoluntary_ctxt_switches: "
+						  "%llu",
+						  &v) == 1) {
+					t.usage.involuntary = v;
+				}
+			}
+			fclose(f);
+		}
+		threads[tid] = t;
+	}
+	closedir(dir);
+#endif
+	return threads;
+}
+
+static inline BenchUsage bench_diff(const BenchUsage &a, const BenchUsage &b)
+{
+	return {b.cpu_ns - a.cpu_ns, b.voluntary - a.voluntary,
+		b.involuntary - a.involuntary};
+}
+
+// One line per thread that ran between the two samples, busiest first.
+static inline void bench_print_threads(const std::map<int, BenchThread> &before,
+				       const std::map<int, BenchThread> &after,
+				       double secs)
+{
+	std::vector<std::pair<int, BenchThread>> ran;
+	for (auto &it : after) {
+		BenchThread t = it.second;
+		auto b = before.find(it.first);
+		if (b != before.end()) {
+			t.usage = bench_diff(b->second.usage, t.usage);
+		}
+		if (t.usage.cpu_ns || t.usage.voluntary ||
+		    t.usage.involuntary) {
+			ran.emplace_back(it.first, t);
+		}
+	}
+	std::sort(ran.begin(), ran.end(), [](const auto &a, const auto &b) {
+		return a.second.usage.cpu_ns > b.second.usage.cpu_ns;
+	});
+	for (auto &it : ran) {
+		const BenchUsage &u = it.second.usage;
+		printf("    thread %-7d %-16s cpu %5.1f%%  switches/s "
+		       "%8.0f voluntary %8.0f involuntary\n",
+		       it.first, it.second.name.c_str(),
+		       (double)u.cpu_ns / 1e7 / secs,
+		       (double)u.voluntary / secs,
+		       (double)u.involuntary / secs);
+	}
+}
+
+static inline void bench_print_process(const BenchUsage &u, double secs)
+{
+	printf("  process: cpu %.1f%% of a core, switches/s %.0f voluntary "
+	       "%.0f involuntary\n",
+	       (double)u.cpu_ns / 1e7 / secs, (double)u.voluntary / secs,
+	       (double)u.involuntary / secs);
+}
+
+// p in [0, 1]. Sorts v.
+static inline uint64_t bench_percentile(std::vector<uint64_t> &v, double p)
+{
+	if (v.empty()) {
+		return 0;
+	}
+	std::sort(v.begin(), v.end());
+	size_t i = (size_t)(p * (double)(v.size() - 1) + 0.5);
+	return v[std::min(i, v.size() - 1)];
+}
+
+#endif //OBS_SSP_BENCH_UTIL_H
@@ -0,0 +1,342 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+/*
+ * Connector pipe benchmark: writer processes stand in for ssp-connector and
+ * send video-sized Message records at a fixed bit rate, SspPipeReactor reads
+ * them like it reads the connectors. Reports per run the rate received, the
+ * reactor's reads and syscalls, pipe latency, and CPU time and context
+ * switches of the reader threads and of the writers.
+ *
+ * Every session runs in one of the two connector modes: "iso" gives each
+ * session a writer and pipe of its own, "mux" sends all sessions through
+ * one writer with the stream id set, and the reader routes them through a
+ * session table the way SSPConnectorMux does. The writers only stand in for
+ * the connector's pipe traffic, what libssp costs per camera is not part of
+ * it.
+ *
+ *   ssp-pipe-bench [--sessions N] [--mode iso|mux] [--mbps M] [--fps F]
+ *                  [--seconds S]
+ *
+ * Without --sessions it runs 1, 4, 8 and 16 sessions at M Mbps each (150 by
+ * default), without --mode in both modes. SSP_PIPE_REACTOR=io_uring, epoll
+ * or threads picks the reactor backend, the default is the first that
+ * works.
+ */
+
+#include <obs.h>
+#include <util/platform.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "ssp-pipe-reactor.h"
+#include "bench-util.h"
+
+struct BenchOptions {
+	int mbps = 150;
+	int fps = 60;
+	int seconds = 10;
+};
+
+// Shared by all sessions of a run, callbacks come from the reader threads
+struct BenchReceived {
+	std::mutex lock;
+	std::vector<uint64_t> latency_us;
+	uint64_t bytes = 0;
+	uint64_t messages = 0;
+	uint64_t unrouted = 0;
+};
+
+struct BenchSession {
+	int dispatching = 0;
+	uint64_t messages = 0;
+};
+
+// What SSPConnectorMux keeps to route messages by stream id
+struct BenchSessions {
+	std::mutex lock;
+	std::map<uint32_t, BenchSession> sessions;
+};
+
+static size_t bench_frame_bytes(const BenchOptions &opt)
+{
+	size_t bytes = (size_t)opt.mbps * 1000000 / 8 / opt.fps;
+	return std::max(bytes, sizeof(uint64_t));
+}
+
+// posix_spawn does not search PATH, the writers need the full path.
+static std::string bench_self(const char *argv0)
+{
+#ifdef __linux__
+	char path[4096];
+	ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (n > 0) {
+		path[n] = 0;
+		return path;
+	}
+#endif
+	return argv0;
+}
+
+static bool bench_write_all(const uint8_t *data, size_t len)
+{
+	while (len) {
+		ssize_t n = write(STDOUT_FILENO, data, len);
+		if (n <= 0) {
+			return false;
+		}
+		data += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
+
+/*
+ * Writer side, run as a child of the benchmark: a frame per stream every
+ * frame interval, each stamped with the time it was written.
+ */
+static int bench_write(const BenchOptions &opt, uint32_t streams)
+{
+	size_t payload = bench_frame_bytes(opt);
+	std::vector<uint8_t> buf(sizeof(Message) + payload, 0x55);
+	Message *msg = (Message *)buf.data();
+	msg->type = VideoDataMsg;
+	msg->length = (uint32_t)payload;
+	uint64_t interval_ns = 1000000000ULL / opt.fps;
+	uint64_t frames = (uint64_t)opt.fps * opt.seconds;
+	uint64_t start = os_gettime_ns();
+	for (uint64_t n = 0; n < frames; ++n) {
+		os_sleepto_ns(start + n * interval_ns);
+		for (uint32_t s = 0; s < streams; ++s) {
+			msg->stream = streams > 1 ? s + 1 : 0;
+			uint64_t now = os_gettime_ns();
+			memcpy(msg->value, &now, sizeof(now));
+			if (!bench_write_all(buf.data(), buf.size())) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void bench_receive(BenchReceived &received, BenchSession *session,
+			  Message *msg)
+{
+	uint64_t sent;
+	memcpy(&sent, msg->value, sizeof(sent));
+	uint64_t now = os_gettime_ns();
+	std::lock_guard<std::mutex> lock(received.lock);
+	received.latency_us.push_back((now - sent) / 1000);
+	received.bytes += sizeof(Message) + msg->length;
+	received.messages++;
+	if (session) {
+		session->messages++;
+	} else {
+		received.unrouted++;
+	}
+}
+
+// The acquire and release around every message of SSPConnectorMux
+static void bench_route(BenchReceived &received, BenchSessions &table,
+			Message *msg)
+{
+	BenchSession *session = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(table.lock);
+		auto it = table.sessions.find(msg->stream);
+		if (it != table.sessions.end()) {
+			session = &it->second;
+			session->dispatching++;
+		}
+	}
+	bench_receive(received, session, msg);
+	if (session) {
+		std::lock_guard<std::mutex> lock(table.lock);
+		session->dispatching--;
+	}
+}
+
+static os_process_pipe_t *bench_spawn(const char *self, const BenchOptions &opt,
+				      int streams)
+{
+	os_process_args_t *args = os_process_args_create(self);
+	os_process_args_add_arg(args, "--write");
+	os_process_args_add_argf(args, "%d", opt.mbps);
+	os_process_args_add_argf(args, "%d", opt.fps);
+	os_process_args_add_argf(args, "%d", opt.seconds);
+	os_process_args_add_argf(args, "%d", streams);
+	os_process_pipe_t *pipe = os_process_pipe_create2(args, "r");
+	os_process_args_destroy(args);
+	return pipe;
+}
+
+static void bench_run(const char *self, int sessions, bool mux,
+		      const BenchOptions &opt)
+{
+	SspPipeReactor *reactor = SspPipeReactor::instance();
+	BenchReceived received;
+	received.latency_us.reserve((size_t)sessions * opt.fps * opt.seconds);
+	BenchSessions table;
+	for (int i = 0; i < sessions; ++i) {
+		table.sessions[sessions > 1 ? i + 1 : 0] = {};
+	}
+	std::vector<BenchSession> own(mux ? 0 : sessions);
+	SspPipeGroup readers;
+	std::vector<os_process_pipe_t *> pipes;
+
+	struct rusage children_before = {};
+	getrusage(RUSAGE_CHILDREN, &children_before);
+	auto threads_before = bench_threads();
+	BenchUsage before = bench_process_usage();
+	SspPipeReactor::Stats reactor_before = reactor->stats();
+	uint64_t start = os_gettime_ns();
+	int spawn = mux ? 1 : sessions;
+	for (int i = 0; i < spawn; ++i) {
+		os_process_pipe_t *pipe =
+			bench_spawn(self, opt, mux ? sessions : 1);
+		if (!pipe) {
+			fprintf(stderr, "cannot start writer %d\n", i);
+			continue;
+		}
+		pipes.push_back(pipe);
+		std::function<void(Message *)> cb;
+		if (mux) {
+			cb = [&received, &table](Message *msg) {
+				bench_route(received, table, msg);
+			};
+		} else {
+			// A connector of its own calls straight into its client
+			BenchSession *session = &own[i];
+			cb = [&received, session](Message *msg) {
+				bench_receive(received, session, msg);
+			};
+		}
+		reactor->add(pipe, SSP_PIPE_OUT, "bench", cb,
+			     readers.closer());
+		reactor->add(pipe, SSP_PIPE_ERR, "bench", nullptr,
+			     readers.closer());
+	}
+	// Every channel closes at the writer's EOF
+	readers.wait();
+	double secs = (double)(os_gettime_ns() - start) / 1e9;
+	SspPipeReactor::Stats reactor_after = reactor->stats();
+	BenchUsage usage = bench_diff(before, bench_process_usage());
+	auto threads_after = bench_threads();
+	for (os_process_pipe_t *pipe : pipes) {
+		os_process_pipe_destroy(pipe);
+	}
+	struct rusage children = {};
+	getrusage(RUSAGE_CHILDREN, &children);
+
+	printf("%d sessions, %s, at %d Mbps, %d fps, %s:\n", sessions,
+	       mux ? "one shared connector" : "a connector each", opt.mbps,
+	       opt.fps, reactor->backend());
+	uint64_t fewest = UINT64_MAX;
+	if (mux) {
+		for (auto &it : table.sessions) {
+			fewest = std::min(fewest, it.second.messages);
+		}
+	} else {
+		for (auto &session : own) {
+			fewest = std::min(fewest, session.messages);
+		}
+	}
+	printf("  received %.1f Mbps, %.0f msgs/s, fewest %llu of %llu for a "
+	       "session, %llu unrouted\n",
+	       (double)received.bytes * 8.0 / 1e6 / secs,
+	       (double)received.messages / secs, (unsigned long long)fewest,
+	       (unsigned long long)opt.fps * opt.seconds,
+	       (unsigned long long)received.unrouted);
+	if (strcmp(reactor->backend(), "threads") != 0) {
+		printf("  reactor: %.0f reads/s, %.0f syscalls/s\n",
+		       (double)(reactor_after.reads - reactor_before.reads) /
+			       secs,
+		       (double)(reactor_after.syscalls -
+				reactor_before.syscalls) /
+			       secs);
+	}
+	uint64_t p50 = bench_percentile(received.latency_us, 0.5);
+	uint64_t p99 = bench_percentile(received.latency_us, 0.99);
+	printf("  write to callback: p50 %llu us, p99 %llu us\n",
+	       (unsigned long long)p50, (unsigned long long)p99);
+	bench_print_process(usage, secs);
+	bench_print_threads(threads_before, threads_after, secs);
+	BenchUsage writers = {
+		bench_timeval_ns(children.ru_utime) +
+			bench_timeval_ns(children.ru_stime) -
+			bench_timeval_ns(children_before.ru_utime) -
+			bench_timeval_ns(children_before.ru_stime),
+		(uint64_t)(children.ru_nvcsw - children_before.ru_nvcsw),
+		(uint64_t)(children.ru_nivcsw - children_before.ru_nivcsw)};
+	printf("  writers:");
+	bench_print_process(writers, secs);
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions opt;
+	if (argc == 6 && !strcmp(argv[1], "--write")) {
+		opt.mbps = atoi(argv[2]);
+		opt.fps = atoi(argv[3]);
+		opt.seconds = atoi(argv[4]);
+		return bench_write(opt, (uint32_t)atoi(argv[5]));
+	}
+
+	std::vector<int> runs = {1, 4, 8, 16};
+	std::vector<bool> modes = {false, true};
+	for (int i = 1; i + 1 < argc; i += 2) {
+		const char *arg = argv[i];
+		int v = atoi(argv[i + 1]);
+		if (!strcmp(arg, "--sessions")) {
+			runs = {v};
+		} else if (!strcmp(arg, "--mode")) {
+			if (!strcmp(argv[i + 1], "iso")) {
+				modes = {false};
+			} else if (!strcmp(argv[i + 1], "mux")) {
+				modes = {true};
+			} else {
+				fprintf(stderr, "unknown mode %s\n",
+					argv[i + 1]);
+				return 1;
+			}
+		} else if (!strcmp(arg, "--mbps")) {
+			opt.mbps = v;
+		} else if (!strcmp(arg, "--fps")) {
+			opt.fps = v;
+		} else if (!strcmp(arg, "--seconds")) {
+			opt.seconds = v;
+		} else {
+			fprintf(stderr, "unknown option %s\n", arg);
+			return 1;
+		}
+	}
+	if (opt.mbps <= 0 || opt.fps <= 0 || opt.seconds <= 0 ||
+	    runs[0] <= 0) {
+		fprintf(stderr, "bad options\n");
+		return 1;
+	}
+	std::string self = bench_self(argv[0]);
+	for (bool mux : modes) {
+		for (int sessions : runs) {
+			bench_run(self.c_str(), sessions, mux, opt);
+		}
+	}
+	SspPipeReactor::destroyInstance();
+	return 0;
+}
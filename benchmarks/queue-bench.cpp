@@ -0,0 +1,319 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+/*
+ * Decode queue benchmark: N sources feed their decode queue from a receive
+ * thread each at the camera frame rate, the frame callback stands in for
+ * the decoder by spinning for a fixed time. Reports per run the enqueue to
+ * callback latency, frames decoded per second, what the queues dropped, CPU
+ * time and context switches of every thread.
+ *
+ * Each run uses one of two queues: "ring" is VFrameQueue, the SPSC ring on
+ * the shared worker pool, "baseline" the mutex and semaphore queue with a
+ * thread per source it replaced (baseline-queue.h).
+ *
+ * Frames carry the number of the reference frame they depend on, so the
+ * callback also counts frames delivered after their reference was dropped.
+ * For the ring that has to stay 0 however overloaded the run is.
+ *
+ *   ssp-queue-bench [--queue ring|baseline] [--sources N] [--fps F]
+ *                   [--decode-us U] [--frame-bytes B] [--gop G] [--seconds S]
+ *
+ * Without --sources it runs 1, 4, 8 and 16, without --fps at 60 and 120,
+ * without --queue both queues.
+ */
+
+#include <obs.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "VFrameQueue.h"
+#include "WorkerPool.h"
+#include "baseline-queue.h"
+#include "bench-util.h"
+extern "C" {
+#include <libavutil/buffer.h>
+}
+
+struct BenchOptions {
+	int fps = 60;
+	uint64_t decode_us = 3000;
+	size_t frame_bytes = 100000;
+	uint32_t gop = 60;
+	int seconds = 10;
+};
+
+// Receive threads stay around until their numbers have been taken.
+struct BenchGate {
+	std::mutex lock;
+	std::condition_variable cond;
+	int producing = 0;
+	bool open = false;
+};
+
+struct BenchSource {
+	VFrameQueue queue;
+	BaselineVFrameQueue baselineQueue;
+	bool baseline = false;
+	std::thread producer;
+	// Callback side, one worker at a time per queue
+	std::vector<uint64_t> latency_us;
+	uint32_t last_ref = 0;
+	bool chain = false;
+	uint64_t delivered = 0;
+	uint64_t broken = 0;
+};
+
+static void bench_spin(uint64_t us)
+{
+	uint64_t until = os_gettime_ns() + us * 1000;
+	while (os_gettime_ns() < until) {
+	}
+}
+
+static void bench_deliver(BenchSource *src, const BenchOptions &opt,
+			  imf::SspH264Data *data, AVBufferRef *buf)
+{
+	src->latency_us.push_back(os_gettime_ns() / 1000 - data->pts);
+	uint32_t ref;
+	memcpy(&ref, data->data, sizeof(ref));
+	bool reference = data->data[sizeof(ref)] != 0;
+	bool idr = data->type == 5;
+	if (idr) {
+		src->chain = true;
+	} else if (!src->chain || ref != src->last_ref) {
+		src->broken++;
+	}
+	if (reference) {
+		src->last_ref = data->frm_no;
+	}
+	src->delivered++;
+	bench_spin(opt.decode_us);
+	av_buffer_unref(&buf);
+}
+
+/*
+ * The receive thread of one camera: an IDR every gop frames, in between
+ * reference and non-reference frames take turns. The payload starts with
+ * the number of the frame it references and whether it is a reference.
+ */
+static void bench_produce(BenchSource *src, const BenchOptions &opt,
+			  BenchGate *gate, uint64_t start_ns, uint64_t frames)
+{
+	os_set_thread_name("bench-recv");
+	std::vector<uint8_t> payload(opt.frame_bytes, 0x55);
+	uint64_t interval_ns = 1000000000ULL / opt.fps;
+	uint32_t last_ref = 0;
+	for (uint64_t n = 0; n < frames; ++n) {
+		uint64_t due = start_ns + n * interval_ns;
+		uint64_t now = os_gettime_ns();
+		if (due > now) {
+			os_sleepto_ns(due);
+		}
+		uint32_t seq = (uint32_t)n;
+		bool idr = n % opt.gop == 0;
+		bool reference = idr || (n % opt.gop) % 2 == 1;
+		memcpy(payload.data(), &last_ref, sizeof(last_ref));
+		payload[sizeof(last_ref)] = reference;
+
+		imf::SspH264Data data = {};
+		data.data = payload.data();
+		data.len = payload.size();
+		data.pts = os_gettime_ns() / 1000;
+		data.frm_no = seq;
+		data.type = idr ? 5 : 1;
+		if (src->baseline) {
+			src->baselineQueue.enqueue(data, data.pts, idr);
+		} else {
+			src->queue.enqueue(data, data.pts, idr, reference);
+		}
+		if (reference) {
+			last_ref = seq;
+		}
+	}
+	std::unique_lock<std::mutex> lock(gate->lock);
+	gate->producing--;
+	gate->cond.notify_all();
+	gate->cond.wait(lock, [gate] { return gate->open; });
+}
+
+static uint32_t bench_depth(BenchSource *src)
+{
+	return src->baseline ? src->baselineQueue.depth() : src->queue.depth();
+}
+
+static void bench_run(int sources, bool baseline, const BenchOptions &opt)
+{
+	std::vector<std::unique_ptr<BenchSource>> srcs;
+	for (int i = 0; i < sources; ++i) {
+		srcs.emplace_back(new BenchSource);
+		BenchSource *src = srcs.back().get();
+		src->latency_us.reserve((size_t)opt.fps * opt.seconds);
+		src->baseline = baseline;
+		if (baseline) {
+			// It has no buffers to hand over, only the data
+			src->baselineQueue.setFrameCallback(
+				[src, &opt](imf::SspH264Data *data) {
+					bench_deliver(src, opt, data, nullptr);
+				});
+			src->baselineQueue.start();
+			continue;
+		}
+		src->queue.setFrameCallback(
+			[src, &opt](imf::SspH264Data *data, AVBufferRef *buf,
+				    uint16_t, uint32_t) {
+				bench_deliver(src, opt, data, buf);
+			});
+		src->queue.setName("bench");
+		src->queue.start();
+	}
+
+	auto threads_before = bench_threads();
+	BenchUsage before = bench_process_usage();
+	uint64_t start = os_gettime_ns();
+	uint64_t frames = (uint64_t)opt.fps * opt.seconds;
+	BenchGate gate;
+	gate.producing = sources;
+	for (auto &src : srcs) {
+		src->producer = std::thread(bench_produce, src.get(),
+					    std::cref(opt), &gate, start,
+					    frames);
+	}
+	{
+		std::unique_lock<std::mutex> lock(gate.lock);
+		gate.cond.wait(lock, [&gate] { return !gate.producing; });
+	}
+	// Let the queues drain, a healthy run is done within a frame
+	uint64_t deadline = os_gettime_ns() + 2000000000ULL;
+	for (auto &src : srcs) {
+		while (bench_depth(src.get()) && os_gettime_ns() < deadline) {
+			os_sleep_ms(1);
+		}
+	}
+	double secs = (double)(os_gettime_ns() - start) / 1e9;
+	BenchUsage usage = bench_diff(before, bench_process_usage());
+	auto threads_after = bench_threads();
+	{
+		std::lock_guard<std::mutex> lock(gate.lock);
+		gate.open = true;
+		gate.cond.notify_all();
+	}
+	for (auto &src : srcs) {
+		src->producer.join();
+	}
+
+	std::vector<uint64_t> latency;
+	uint64_t delivered = 0, broken = 0, dropped = 0, skipped = 0;
+	for (auto &src : srcs) {
+		if (baseline) {
+			src->baselineQueue.stop();
+			dropped += src->baselineQueue.dropped();
+		} else {
+			src->queue.stop();
+			dropped += src->queue.dropped();
+			skipped += src->queue.skipped();
+		}
+		latency.insert(latency.end(), src->latency_us.begin(),
+			       src->latency_us.end());
+		delivered += src->delivered;
+		broken += src->broken;
+	}
+	printf("%s queue, %d sources, %d fps, %llu us decode, %zu byte "
+	       "frames:\n",
+	       baseline ? "baseline" : "ring", sources, opt.fps,
+	       (unsigned long long)opt.decode_us, opt.frame_bytes);
+	printf("  frames: %llu sent, %llu decoded, %llu dropped (%llu rest "
+	       "of GOP), %llu decoded without their reference\n",
+	       (unsigned long long)(frames * sources),
+	       (unsigned long long)delivered, (unsigned long long)dropped,
+	       (unsigned long long)skipped, (unsigned long long)broken);
+	uint64_t p50 = bench_percentile(latency, 0.5);
+	uint64_t p99 = bench_percentile(latency, 0.99);
+	printf("  latency: p50 %llu us, p99 %llu us, max %llu us\n",
+	       (unsigned long long)p50, (unsigned long long)p99,
+	       (unsigned long long)(latency.empty() ? 0 : latency.back()));
+	printf("  throughput: %.0f frames/s decoded of %.0f sent\n",
+	       (double)delivered / secs, (double)(frames * sources) / secs);
+	if (!baseline) {
+		auto pool = WorkerPool::instance()->stats();
+		printf("  pool: %u workers, %llu runs, %llu steals, %llu idle "
+		       "waits (since start)\n",
+		       pool.workers, (unsigned long long)pool.runs,
+		       (unsigned long long)pool.steals,
+		       (unsigned long long)pool.sleeps);
+	}
+	bench_print_process(usage, secs);
+	bench_print_threads(threads_before, threads_after, secs);
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions opt;
+	std::vector<int> runs = {1, 4, 8, 16};
+	std::vector<int> rates = {60, 120};
+	std::vector<bool> queues = {true, false};
+	for (int i = 1; i + 1 < argc; i += 2) {
+		const char *arg = argv[i];
+		long v = atol(argv[i + 1]);
+		if (!strcmp(arg, "--sources")) {
+			runs = {(int)v};
+		} else if (!strcmp(arg, "--queue")) {
+			if (!strcmp(argv[i + 1], "ring")) {
+				queues = {false};
+			} else if (!strcmp(argv[i + 1], "baseline")) {
+				queues = {true};
+			} else {
+				fprintf(stderr, "unknown queue %s\n",
+					argv[i + 1]);
+				return 1;
+			}
+		} else if (!strcmp(arg, "--fps")) {
+			rates = {(int)v};
+		} else if (!strcmp(arg, "--decode-us")) {
+			opt.decode_us = (uint64_t)v;
+		} else if (!strcmp(arg, "--frame-bytes")) {
+			opt.frame_bytes = (size_t)v;
+		} else if (!strcmp(arg, "--gop")) {
+			opt.gop = (uint32_t)v;
+		} else if (!strcmp(arg, "--seconds")) {
+			opt.seconds = (int)v;
+		} else {
+			fprintf(stderr, "unknown option %s\n", arg);
+			return 1;
+		}
+	}
+	if (rates[0] <= 0 || runs[0] <= 0 || opt.seconds <= 0 || !opt.gop ||
+	    opt.frame_bytes <= sizeof(uint32_t)) {
+		fprintf(stderr, "bad options\n");
+		return 1;
+	}
+	for (bool baseline : queues) {
+		for (int fps : rates) {
+			opt.fps = fps;
+			for (int sources : runs) {
+				bench_run(sources, baseline, opt);
+			}
+		}
+	}
+	WorkerPool::destroyInstance();
+	return 0;
+}
@@ -0,0 +1,147 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <string.h>
+#include <util/platform.h>
+#include "AFrameQueue.h"
+
+void AFrameQueue::Stat::add(uint64_t ns)
+{
+	sum += ns;
+	count++;
+	if (ns > max) {
+		max = ns;
+	}
+}
+
+void AFrameQueue::Stat::take(Timing *t)
+{
+	uint64_t n = count.exchange(0);
+	uint64_t total = sum.exchange(0);
+	t->count = n;
+	t->avg_us = n ? total / n / 1000 : 0;
+	t->max_us = max.exchange(0) / 1000;
+}
+
+AFrameQueue::AFrameQueue()
+{
+	head = 0;
+	tail = 0;
+	sleeping = false;
+	running = false;
+	droppedFrames = 0;
+}
+
+AFrameQueue::~AFrameQueue()
+{
+	stop();
+}
+
+void AFrameQueue::start()
+{
+	running = true;
+	thread = std::thread(&AFrameQueue::run, this);
+}
+
+void AFrameQueue::stop()
+{
+	if (!thread.joinable()) {
+		return;
+	}
+	running = false;
+	{
+		std::lock_guard<std::mutex> lock(wakeLock);
+		wakeCond.notify_one();
+	}
+	thread.join();
+	tail = head.load();
+}
+
+uint32_t AFrameQueue::depth()
+{
+	return head.load(std::memory_order_relaxed) -
+	       tail.load(std::memory_order_relaxed);
+}
+
+void AFrameQueue::timing(Timing *enqueue, Timing *decode)
+{
+	enqueueTime.take(enqueue);
+	decodeTime.take(decode);
+}
+
+bool AFrameQueue::enqueue(const imf::SspAudioData *data)
+{
+	uint64_t start = os_gettime_ns();
+	uint32_t h = head.load(std::memory_order_relaxed);
+	if (h - tail.load(std::memory_order_acquire) >= AFRAME_QUEUE_SIZE) {
+		droppedFrames++;
+		return false;
+	}
+	Frame &f = frames[h % AFRAME_QUEUE_SIZE];
+	f.buf.resize(data->len);
+	if (data->len) {
+		memcpy(f.buf.data(), data->data, data->len);
+	}
+	f.data = *data;
+	f.data.data = f.buf.data();
+	head.store(h + 1, std::memory_order_seq_cst);
+
+	if (sleeping.load(std::memory_order_seq_cst)) {
+		std::lock_guard<std::mutex> lock(wakeLock);
+		wakeCond.notify_one();
+	}
+	enqueueTime.add(os_gettime_ns() - start);
+	return true;
+}
+
+// Waits for the next packet, false once the queue is stopped.
+bool AFrameQueue::pop(uint32_t *slot)
+{
+	while (running) {
+		uint32_t t = tail.load(std::memory_order_relaxed);
+		if (head.load(std::memory_order_acquire) != t) {
+			*slot = t;
+			return true;
+		}
+		// enqueue notifies under wakeLock once it sees sleeping, so
+		// head checked under it cannot move without waking us
+		sleeping.store(true, std::memory_order_seq_cst);
+		{
+			std::unique_lock<std::mutex> lock(wakeLock);
+			wakeCond.wait(lock, [this, t] {
+				return !running ||
+				       head.load(std::memory_order_seq_cst) !=
+					       t;
+			});
+		}
+		sleeping = false;
+	}
+	return false;
+}
+
+void AFrameQueue::run()
+{
+	uint32_t t;
+	while (pop(&t)) {
+		// The slot stays ours until tail moves past it, no copy out
+		uint64_t start = os_gettime_ns();
+		callback(&frames[t % AFRAME_QUEUE_SIZE].data);
+		decodeTime.add(os_gettime_ns() - start);
+		tail.store(t + 1, std::memory_order_release);
+	}
+}
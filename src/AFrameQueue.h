@@ -0,0 +1,93 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_AFRAMEQUEUE_H
+#define OBS_SSP_AFRAMEQUEUE_H
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <imf/ISspClient.h>
+
+// Slots in the ring, a power of two. About a second of AAC at 48 kHz.
+#define AFRAME_QUEUE_SIZE 64
+
+/*
+ * Audio decode stage. The receive thread only copies the packet into the
+ * ring, decoding and obs_source_output_audio run on the queue's thread, so
+ * neither stream waits for the other.
+ *
+ * Single producer / single consumer like VFrameQueue. Slot buffers are kept
+ * across packets, audio packets are small and about the same size, so the
+ * ring stops allocating after the first few.
+ */
+class AFrameQueue {
+	struct Frame {
+		std::vector<uint8_t> buf;
+		imf::SspAudioData data;
+	};
+	typedef std::function<void(imf::SspAudioData *)> CallbackFunc;
+
+public:
+	struct Timing {
+		uint64_t count;
+		uint64_t avg_us;
+		uint64_t max_us;
+	};
+
+	AFrameQueue();
+	~AFrameQueue();
+	void setFrameCallback(CallbackFunc cb) { callback = std::move(cb); }
+	void start();
+	void stop();
+	// Producer side, never blocks. False when the ring is full.
+	bool enqueue(const imf::SspAudioData *data);
+	uint32_t depth();
+	uint64_t dropped() { return droppedFrames; }
+	// Receive thread time per packet and decode time per packet, both
+	// since the last call.
+	void timing(Timing *enqueue, Timing *decode);
+
+private:
+	struct Stat {
+		std::atomic<uint64_t> sum{0};
+		std::atomic<uint64_t> count{0};
+		std::atomic<uint64_t> max{0};
+		void add(uint64_t ns);
+		void take(Timing *t);
+	};
+
+	void run();
+	bool pop(uint32_t *slot);
+	CallbackFunc callback;
+	Frame frames[AFRAME_QUEUE_SIZE];
+	alignas(64) std::atomic<uint32_t> head; // producer
+	alignas(64) std::atomic<uint32_t> tail; // consumer
+	std::atomic<bool> sleeping;
+	std::atomic<bool> running;
+	std::mutex wakeLock;
+	std::condition_variable wakeCond;
+	std::thread thread;
+	std::atomic<uint64_t> droppedFrames;
+	Stat enqueueTime;
+	Stat decodeTime;
+};
+
+#endif //OBS_SSP_AFRAMEQUEUE_H
@@ -0,0 +1,122 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "DecodeBudget.h"
+
+std::mutex DecodeBudget::instanceLock;
+DecodeBudget *DecodeBudget::s_instance = nullptr;
+
+DecodeBudget *DecodeBudget::instance()
+{
+	std::lock_guard<std::mutex> lock(instanceLock);
+	if (!s_instance) {
+		int count = (int)std::thread::hardware_concurrency();
+		s_instance = new DecodeBudget(count < 2 ? 2 : count);
+	}
+	return s_instance;
+}
+
+void DecodeBudget::destroyInstance()
+{
+	std::lock_guard<std::mutex> lock(instanceLock);
+	delete s_instance;
+	s_instance = nullptr;
+}
+
+DecodeBudget::DecodeBudget(int budget) : budget(budget) {}
+
+void DecodeBudget::set(const void *owner, uint64_t pixelRate)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = entries.find(owner);
+	if (it != entries.end() && it->second.rate == pixelRate) {
+		return;
+	}
+	entries[owner].rate = pixelRate;
+	rebalance();
+}
+
+void DecodeBudget::remove(const void *owner)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (entries.erase(owner)) {
+		rebalance();
+	}
+}
+
+int DecodeBudget::threads(const void *owner)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = entries.find(owner);
+	if (it == entries.end()) {
+		entries[owner].rate = DECODE_BUDGET_DEFAULT_RATE;
+		rebalance();
+		it = entries.find(owner);
+	}
+	return it->second.threads;
+}
+
+DecodeBudget::Stats DecodeBudget::stats()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	Stats st = {budget, 0, (int)entries.size()};
+	for (auto &it : entries) {
+		st.assigned += it.second.threads;
+	}
+	return st;
+}
+
+void DecodeBudget::rebalance()
+{
+	const uint64_t unit = DECODE_BUDGET_PIXELS_PER_THREAD;
+	uint64_t total = 0;
+	for (auto &it : entries) {
+		uint64_t need = (it.second.rate + unit - 1) / unit;
+		if (need < 1) {
+			need = 1;
+		} else if (need > DECODE_BUDGET_MAX_THREADS) {
+			need = DECODE_BUDGET_MAX_THREADS;
+		}
+		it.second.threads = (int)need;
+		total += need;
+	}
+	if (total <= (uint64_t)budget) {
+		return;
+	}
+	// Shares rounded down, what that leaves goes to the largest remainders
+	std::vector<std::pair<uint64_t, Entry *>> rest;
+	int left = budget;
+	for (auto &it : entries) {
+		uint64_t scaled = (uint64_t)it.second.threads * budget;
+		int share = (int)(scaled / total);
+		it.second.threads = share < 1 ? 1 : share;
+		left -= it.second.threads;
+		rest.emplace_back(scaled % total, &it.second);
+	}
+	std::sort(rest.begin(), rest.end(),
+		  [](const std::pair<uint64_t, Entry *> &a,
+		     const std::pair<uint64_t, Entry *> &b) {
+			  return a.first > b.first;
+		  });
+	for (size_t i = 0; left > 0 && i < rest.size(); ++i, --left) {
+		rest[i].second->threads++;
+	}
+}
@@ -0,0 +1,88 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_DECODEBUDGET_H
+#define OBS_SSP_DECODEBUDGET_H
+#include <stdint.h>
+#include <map>
+#include <mutex>
+
+// Pixels per second one decoder thread is counted for, 1080p30.
+#define DECODE_BUDGET_PIXELS_PER_THREAD (1920ULL * 1080 * 30)
+// Until the stream meta is known.
+#define DECODE_BUDGET_DEFAULT_RATE DECODE_BUDGET_PIXELS_PER_THREAD
+// Most threads one decoder gets, more rarely helps.
+#define DECODE_BUDGET_MAX_THREADS 16
+// Smallest change of share a decoder is reopened for, rounding moves
+// shares by one whenever a source comes or goes.
+#define DECODE_BUDGET_REOPEN_DELTA 2
+
+/*
+ * Splits one decoder thread per core between the video decoders of all
+ * sources, so libavcodec's thread_count 0 (a thread per core each) does not
+ * oversubscribe the CPU once there are several cameras. A decoder needs a
+ * thread per DECODE_BUDGET_PIXELS_PER_THREAD of its stream; when all needs
+ * do not fit, each gets a share in proportion, at least one thread. Shares
+ * are worked out again whenever a source comes, goes or changes its stream.
+ *
+ * thread_count is fixed once a decoder is open, so a new share only takes
+ * effect when its owner opens the next decoder. Owners reopen for it only
+ * when it moved by DECODE_BUDGET_REOPEN_DELTA or more.
+ */
+class DecodeBudget {
+public:
+	struct Stats {
+		int budget;
+		int assigned;
+		int sources;
+	};
+
+	static DecodeBudget *instance();
+	static void destroyInstance();
+
+	// Adds owner's decoder or updates its stream, in pixels per second.
+	void set(const void *owner, uint64_t pixelRate);
+	void remove(const void *owner);
+	// thread_count for the next decoder owner opens.
+	int threads(const void *owner);
+	// Whether a decoder open with current threads should move to share.
+	static bool reopen(int current, int share)
+	{
+		int delta = share > current ? share - current : current - share;
+		return delta >= DECODE_BUDGET_REOPEN_DELTA;
+	}
+	Stats stats();
+
+private:
+	struct Entry {
+		uint64_t rate;
+		int threads;
+	};
+
+	explicit DecodeBudget(int budget);
+	void rebalance();
+
+	std::mutex lock;
+	std::map<const void *, Entry> entries;
+	int budget;
+
+	static std::mutex instanceLock;
+	static DecodeBudget *s_instance;
+};
+
+#endif //OBS_SSP_DECODEBUDGET_H
@@ -0,0 +1,160 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <util/platform.h>
+#include "VFramePool.h"
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+static_assert(VFRAME_POOL_PADDING >= AV_INPUT_BUFFER_PADDING_SIZE,
+	      "frame buffers need libavcodec's padding");
+
+VFramePool::VFramePool()
+{
+	for (size_t i = 0; i < VFRAME_POOL_CLASSES; ++i) {
+		minFree[i] = 0;
+	}
+	lastTrim = 0;
+	counters = {};
+	users = 1;
+}
+
+VFramePool::~VFramePool()
+{
+	for (auto &list : freeLists) {
+		for (auto buf : list) {
+			free(buf);
+		}
+	}
+}
+
+void VFramePool::release()
+{
+	if (--users == 0) {
+		delete this;
+	}
+}
+
+uint8_t *VFramePool::get(size_t size)
+{
+	size_t need = size + VFRAME_POOL_PADDING + sizeof(Header);
+	uint32_t cls = 0;
+	while (cls < VFRAME_POOL_CLASSES &&
+	       ((size_t)1 << (cls + VFRAME_POOL_MIN_SHIFT)) < need) {
+		++cls;
+	}
+	size_t alloc = cls < VFRAME_POOL_CLASSES
+			       ? (size_t)1 << (cls + VFRAME_POOL_MIN_SHIFT)
+			       : need;
+
+	std::lock_guard<std::mutex> guard(lock);
+	Header *buf = nullptr;
+	if (cls < VFRAME_POOL_CLASSES && !freeLists[cls].empty()) {
+		buf = freeLists[cls].back();
+		freeLists[cls].pop_back();
+		if (freeLists[cls].size() < minFree[cls]) {
+			minFree[cls] = freeLists[cls].size();
+		}
+		counters.free -= alloc;
+		counters.hits++;
+	} else {
+		buf = (Header *)malloc(alloc);
+		if (!buf) {
+			return nullptr;
+		}
+		buf->cls = cls;
+		buf->size = alloc;
+		counters.misses++;
+		counters.resident += alloc;
+		if (counters.resident > counters.high_water) {
+			counters.high_water = counters.resident;
+		}
+	}
+	auto data = (uint8_t *)(buf + 1);
+	memset(data + size, 0, VFRAME_POOL_PADDING);
+	return data;
+}
+
+AVBufferRef *VFramePool::wrap(uint8_t *data, size_t size)
+{
+	retain();
+	AVBufferRef *buf = av_buffer_create(data, size + VFRAME_POOL_PADDING,
+					    unwrap, this, 0);
+	if (!buf) {
+		release();
+	}
+	return buf;
+}
+
+// Last reference gone, may run on a decoder thread.
+void VFramePool::unwrap(void *opaque, uint8_t *data)
+{
+	auto pool = (VFramePool *)opaque;
+	pool->put(data);
+	pool->release();
+}
+
+void VFramePool::put(uint8_t *data)
+{
+	if (!data) {
+		return;
+	}
+	auto buf = (Header *)data - 1;
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (buf->cls >= VFRAME_POOL_CLASSES ||
+	    counters.free + buf->size > VFRAME_POOL_FREE_BUDGET) {
+		counters.resident -= buf->size;
+		free(buf);
+	} else {
+		freeLists[buf->cls].push_back(buf);
+		counters.free += buf->size;
+	}
+
+	uint64_t now = os_gettime_ns();
+	if (now - lastTrim >= VFRAME_POOL_TRIM_INTERVAL_NS) {
+		trim(now);
+	}
+}
+
+void VFramePool::trim(uint64_t now)
+{
+	for (size_t cls = 0; cls < VFRAME_POOL_CLASSES; ++cls) {
+		auto &list = freeLists[cls];
+		size_t idle = minFree[cls];
+		size_t alloc = (size_t)1 << (cls + VFRAME_POOL_MIN_SHIFT);
+		for (size_t i = 0; i < idle; ++i) {
+			free(list.back());
+			list.pop_back();
+		}
+		counters.resident -= idle * alloc;
+		counters.free -= idle * alloc;
+		counters.trimmed += idle;
+		minFree[cls] = list.size();
+	}
+	lastTrim = now;
+}
+
+VFramePool::Stats VFramePool::stats()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return counters;
+}
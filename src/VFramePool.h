@@ -0,0 +1,92 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_VFRAMEPOOL_H
+#define OBS_SSP_VFRAMEPOOL_H
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Power of two size classes from 16 KiB to 128 MiB, bigger is not pooled.
+#define VFRAME_POOL_MIN_SHIFT 14
+#define VFRAME_POOL_CLASSES 14
+// Most free bytes kept around, buffers returned beyond that are freed.
+#define VFRAME_POOL_FREE_BUDGET (64 * 1024 * 1024)
+#define VFRAME_POOL_TRIM_INTERVAL_NS (10 * 1000000000ULL)
+// Zeroed bytes after every buffer, libavcodec's AV_INPUT_BUFFER_PADDING_SIZE.
+#define VFRAME_POOL_PADDING 64
+
+struct AVBufferRef;
+
+/*
+ * Recycles compressed frame buffers between the receive thread (get) and
+ * the VFrameQueue thread (put). The classes in use grow with the biggest
+ * frames seen. Every trim interval, free buffers a class did not need
+ * during the whole interval are released, so memory follows the stream
+ * back down after a burst of large I-frames.
+ *
+ * Buffers can be handed to libavcodec as they are (wrap), the decoder may
+ * hold them past the queue's lifetime. The pool is reference counted for
+ * that: it goes away once its owner and every wrapped buffer released it.
+ */
+class VFramePool {
+public:
+	struct Stats {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t trimmed;
+		size_t resident; // in use and free
+		size_t free;
+		size_t high_water; // of resident
+	};
+
+	VFramePool();
+	// size bytes, followed by VFRAME_POOL_PADDING zeroed ones
+	uint8_t *get(size_t size);
+	void put(uint8_t *data);
+	// Reference to a buffer from get, which comes back to the pool when
+	// the last one is unreferenced. nullptr when out of memory.
+	AVBufferRef *wrap(uint8_t *data, size_t size);
+	void retain() { users++; }
+	void release();
+	Stats stats();
+
+private:
+	~VFramePool();
+	static void unwrap(void *opaque, uint8_t *data);
+
+	struct Header {
+		uint32_t cls;
+		uint32_t reserved;
+		uint64_t size; // allocation size, keeps data 16 byte aligned
+	};
+
+	void trim(uint64_t now);
+
+	std::mutex lock;
+	std::vector<Header *> freeLists[VFRAME_POOL_CLASSES];
+	// Fewest free buffers a class had during this trim interval
+	size_t minFree[VFRAME_POOL_CLASSES];
+	uint64_t lastTrim;
+	Stats counters;
+	std::atomic<uint32_t> users;
+};
+
+#endif //OBS_SSP_VFRAMEPOOL_H
@@ -16,26 +16,83 @@ You should have received a copy of the GNU General Public License
 along with this program; If not, see <https://www.gnu.org/licenses/>
 */
 
+#include <obs.h>
 #include <util/platform.h>
+#include <obs-avc.h>
+#include "obs-ssp.h"
 #include "VFrameQueue.h"
-#include <QDebug>
+
+std::atomic<size_t> VFrameQueue::budgetUsed{0};
+std::atomic<uint32_t> VFrameQueue::runningQueues{0};
 
 VFrameQueue::VFrameQueue()
 {
 	maxTime = 0;
+	dropSlack = VFRAME_DROP_SLACK_US;
+	head = 0;
+	tail = 0;
+	workers = WorkerPool::instance();
+	pool = new VFramePool;
+	running = false;
+	droppedFrames = 0;
+	skippedFrames = 0;
+	latencySum = 0;
+	latencyCount = 0;
+	latencyMax = 0;
+	queuedBytes = 0;
+	evict = false;
+	refusing = REFUSE_NONE;
+	evictionCount = 0;
+	evictedFrames = 0;
+	lastEvictLog = 0;
+	evictionsLogged = 0;
+	pacing = false;
+	pacedTarget = 0;
+	underrunCount = 0;
+	overrunCount = 0;
+	anchored = false;
+	catchingUp = false;
+	basePts = 0;
+	baseTime = 0;
+	target = VFRAME_JITTER_START;
+	sinceUnderrun = 0;
+	holding = false;
+	holdUntil = 0;
+	started = false;
+	skipToIdr = false;
+	lastFrameTime = 0;
+	processingTime = 0;
+}
+
+VFrameQueue::~VFrameQueue()
+{
+	// Frames still in the decoder keep the pool until they are unreferenced
+	pool->release();
 }
 
 void VFrameQueue::start()
 {
+	runningQueues++;
 	running = true;
-	pthread_create(&thread, nullptr, pthread_run, (void *)this);
 }
 
 void VFrameQueue::stop()
 {
 	running = false;
-	sem.release();
-	pthread_join(thread, nullptr);
+	workers->cancel(this);
+
+	// Producer is stopped by now too, free what was never delivered.
+	if (holding) {
+		release(&current);
+		holding = false;
+	}
+	uint32_t t = tail.load(std::memory_order_relaxed);
+	uint32_t h = head.load(std::memory_order_acquire);
+	for (; t != h; ++t) {
+		release(&frames[t % VFRAME_QUEUE_SIZE]);
+	}
+	tail = t;
+	runningQueues--;
 }
 
 void VFrameQueue::setFrameCallback(VFrameQueue::CallbackFunc cb)
@@ -43,72 +100,324 @@ void VFrameQueue::setFrameCallback(VFrameQueue::CallbackFunc cb)
 	callback = std::move(cb);
 }
 
+uint32_t VFrameQueue::depth()
+{
+	return head.load(std::memory_order_relaxed) -
+	       tail.load(std::memory_order_relaxed);
+}
+
+uint32_t VFrameQueue::backlog()
+{
+	uint32_t queued = depth();
+	uint32_t held = pacedTarget;
+	return queued > held ? queued - held : 0;
+}
+
+void VFrameQueue::latency(uint64_t *avg_us, uint64_t *max_us)
+{
+	uint64_t count = latencyCount.exchange(0);
+	uint64_t sum = latencySum.exchange(0);
+	*avg_us = count ? sum / count / 1000 : 0;
+	*max_us = latencyMax.exchange(0) / 1000;
+}
+
 void VFrameQueue::setFrameTime(uint64_t time_us)
 {
 	maxTime = time_us;
 }
 
-void VFrameQueue::enqueue(imf::SspH264Data data, uint64_t time_us, bool noDrop)
+void VFrameQueue::anchor(uint64_t pts_ns, uint64_t at_ns)
 {
-	QMutexLocker locker(&queueLock);
-	uint8_t *copy_data = (uint8_t *)malloc(data.len);
+	basePts = pts_ns;
+	baseTime = at_ns;
+	anchored = true;
+}
+
+/*
+ * Consumer side, returns when the frame is due, 0 to deliver it right away.
+ * The clock is anchored on the first frame, which plays target intervals
+ * after it arrived; later frames play at that time plus their pts distance
+ * from it. A frame already more than an interval past its time is an
+ * underrun: the buffer was too shallow for the network jitter, so it grows
+ * by one frame. A backlog well past the target is an overrun (a burst, or
+ * the decoder stalled): frames go out without waiting until it is back
+ * down, then the clock is anchored again.
+ */
+uint64_t VFrameQueue::pace(Frame *frame)
+{
+	uint64_t interval = maxTime * 1000;
+	if (!pacing || !interval) {
+		anchored = false;
+		pacedTarget = 0;
+		return 0;
+	}
+	uint64_t pts = frame->time * 1000;
+	uint64_t now = os_gettime_ns();
+	if (!anchored) {
+		target = VFRAME_JITTER_START;
+		sinceUnderrun = 0;
+		catchingUp = false;
+		anchor(pts, now + target * interval);
+	}
+	pacedTarget = target;
+
+	uint32_t queued = depth();
+	if (!catchingUp && queued > target + VFRAME_JITTER_MAX) {
+		overrunCount++;
+		catchingUp = true;
+	}
+	if (catchingUp) {
+		if (queued > target) {
+			return 0;
+		}
+		catchingUp = false;
+		anchor(pts, now);
+		return 0;
+	}
+
+	// pts went back or jumped ahead, the camera clock restarted
+	uint64_t due = baseTime + (pts - basePts);
+	if (pts < basePts || due > now + (VFRAME_JITTER_MAX + 1) * interval) {
+		anchor(pts, now);
+		return 0;
+	}
+
+	if (now > due + interval) {
+		underrunCount++;
+		sinceUnderrun = 0;
+		if (target < VFRAME_JITTER_MAX) {
+			target++;
+			pacedTarget = target;
+		}
+		// Hold this one an interval longer so the buffer refills
+		anchor(pts, now + interval);
+		due = baseTime;
+	} else if (++sinceUnderrun >= VFRAME_JITTER_SHRINK_FRAMES &&
+		   target > VFRAME_JITTER_MIN) {
+		sinceUnderrun = 0;
+		target--;
+		pacedTarget = target;
+		baseTime -= interval;
+		due -= interval;
+	}
+	return due;
+}
+
+/*
+ * The first slice decides: nal_ref_idc 0 in H.264, the even sub-layer
+ * non-reference types below 16 (TRAIL_N, RASL_N, ...) in HEVC.
+ */
+bool VFrameQueue::isReference(const uint8_t *data, size_t len, bool hevc)
+{
+	const uint8_t *end = data + len;
+	const uint8_t *nal = obs_avc_find_startcode(data, end);
+	while (nal < end) {
+		while (nal < end && !*(nal++))
+			;
+		if (nal == end) {
+			break;
+		}
+		if (hevc) {
+			uint8_t type = (nal[0] >> 1) & 0x3f;
+			if (type < 32) {
+				return type >= 16 || (type & 1);
+			}
+		} else {
+			uint8_t type = nal[0] & 0x1f;
+			if (type >= 1 && type <= 5) {
+				return (nal[0] & 0x60) != 0;
+			}
+		}
+		nal = obs_avc_find_startcode(nal, end);
+	}
+	return true;
+}
+
+// Producer side, true when this frame has to go to respect the budget.
+bool VFrameQueue::overBudget(size_t len)
+{
+	uint32_t queues = runningQueues;
+	size_t share = VFRAME_QUEUE_BUDGET / (queues ? queues : 1);
+	if (budgetUsed + len <= VFRAME_QUEUE_BUDGET ||
+	    queuedBytes + len <= share) {
+		return false;
+	}
+
+	evictionCount++;
+	evict = true;
+	refusing = REFUSE_BUDGET;
+
+	uint64_t now = os_gettime_ns();
+	if (now - lastEvictLog >= VFRAME_EVICT_LOG_INTERVAL_NS) {
+		ssp_blog(LOG_WARNING,
+			 "%s decode queue over budget: %zu bytes queued, "
+			 "share %zu, all queues %zu of %zu; %llu evictions",
+			 name.c_str(), (size_t)queuedBytes, share,
+			 (size_t)budgetUsed, VFRAME_QUEUE_BUDGET,
+			 (unsigned long long)(evictionCount - evictionsLogged));
+		lastEvictLog = now;
+		evictionsLogged = evictionCount;
+	}
+	return true;
+}
+
+// Producer side. Frames after a dropped reference frame would decode
+// against a picture the decoder never saw, refuse them up to the next IDR.
+void VFrameQueue::dropOnEnqueue(bool reference)
+{
+	droppedFrames++;
+	if (reference) {
+		refusing = REFUSE_DROP;
+	}
+}
+
+void VFrameQueue::enqueue(imf::SspH264Data data, uint64_t time_us, bool noDrop,
+			  bool reference, uint16_t nalFlags, uint32_t stream)
+{
+	if (refusing != REFUSE_NONE && !noDrop) {
+		droppedFrames++;
+		if (refusing == REFUSE_BUDGET) {
+			evictedFrames++;
+		}
+		return;
+	}
+	refusing = REFUSE_NONE;
+	if (overBudget(data.len)) {
+		droppedFrames++;
+		evictedFrames++;
+		return;
+	}
+
+	uint32_t h = head.load(std::memory_order_relaxed);
+	if (h - tail.load(std::memory_order_acquire) >= VFRAME_QUEUE_SIZE) {
+		// Never block the receive thread, the decoder is hopelessly behind.
+		dropOnEnqueue(reference || noDrop);
+		return;
+	}
+	uint8_t *copy_data = pool->get(data.len);
+	if (!copy_data) {
+		dropOnEnqueue(reference || noDrop);
+		return;
+	}
 	memcpy(copy_data, data.data, data.len);
 	data.data = copy_data;
-	frameQueue.enqueue({data, time_us, noDrop});
-	sem.release();
+	queuedBytes += data.len;
+	budgetUsed += data.len;
+	frames[h % VFRAME_QUEUE_SIZE] = {data,   time_us,   os_gettime_ns(),
+					 noDrop, reference, nalFlags,
+					 stream};
+	head.store(h + 1, std::memory_order_seq_cst);
+	workers->post(this);
 }
 
-void *VFrameQueue::pthread_run(void *q)
+// Takes the next frame if there is one, never waits.
+bool VFrameQueue::pop(Frame *frame)
 {
-	run((VFrameQueue *)q);
-	return nullptr;
+	uint32_t t = tail.load(std::memory_order_relaxed);
+	if (head.load(std::memory_order_acquire) == t) {
+		return false;
+	}
+	*frame = frames[t % VFRAME_QUEUE_SIZE];
+	tail.store(t + 1, std::memory_order_release);
+	return true;
 }
 
-void VFrameQueue::run(VFrameQueue *q)
+bool VFrameQueue::hasWork()
 {
-	Frame current;
-	uint64_t lastFrameTime = 0, lastStartTime = 0, processingTime = 0;
-	q->sem.acquire();
-	q->queueLock.lock();
-	if (q->frameQueue.empty()) {
-		q->queueLock.unlock();
-		return;
+	return running && head.load(std::memory_order_seq_cst) !=
+				  tail.load(std::memory_order_relaxed);
+}
+
+void VFrameQueue::release(Frame *frame)
+{
+	queuedBytes -= frame->data.len;
+	budgetUsed -= frame->data.len;
+	pool->put(frame->data.data);
+}
+
+void VFrameQueue::deliver(Frame *frame)
+{
+	uint64_t waited = os_gettime_ns() - frame->enqueued;
+	latencySum += waited;
+	latencyCount++;
+	if (waited > latencyMax) {
+		latencyMax = waited;
+	}
+	// The decoder takes the buffer itself, release leaves it alone then
+	AVBufferRef *buf = pool->wrap(frame->data.data, frame->data.len);
+	callback(&frame->data, buf, frame->nalFlags, frame->stream);
+	if (buf) {
+		frame->data.data = nullptr;
+	}
+}
+
+/*
+ * Frames too late for the decoder are dropped. Dropping a reference frame
+ * breaks everything after it up to the next IDR, so those are skipped too
+ * rather than decoded into garbage. Non-reference frames go on their own.
+ * The first frame always goes through.
+ */
+bool VFrameQueue::accept(const Frame *frame)
+{
+	if (!started) {
+		started = true;
+		return true;
 	}
-	current = q->frameQueue.dequeue();
-	q->queueLock.unlock();
-	lastStartTime = os_gettime_ns() / 1000;
-	q->callback(&current.data);
-	lastFrameTime = current.time;
-	processingTime = os_gettime_ns() / 1000 - lastStartTime;
-	free((void *)current.data.data);
-	while (q->running) {
-		q->sem.acquire();
-		q->queueLock.lock();
-		if (q->frameQueue.empty()) {
-			q->queueLock.unlock();
-			continue;
+	if (evict.exchange(false)) {
+		skipToIdr = true;
+	}
+	bool late = frame->time < lastFrameTime;
+	if (!late && frame->noDrop) {
+		skipToIdr = false;
+	}
+	if (!late && skipToIdr) {
+		droppedFrames++;
+		skippedFrames++;
+		return false;
+	}
+	if (!late &&
+	    (frame->noDrop ||
+	     frame->time - lastFrameTime + dropSlack > processingTime)) {
+		return true;
+	}
+	droppedFrames++;
+	if (frame->reference) {
+		skipToIdr = true;
+	}
+	return false;
+}
+
+/*
+ * One turn on the shared workers: up to VFRAME_TASK_BATCH frames, then the
+ * other sources get theirs. A paced frame that is not due yet stays in
+ * current and the task comes back at its deadline.
+ */
+uint64_t VFrameQueue::run()
+{
+	for (int n = 0; n < VFRAME_TASK_BATCH; ++n) {
+		if (!running) {
+			return WorkerPool::IDLE;
 		}
-		current = q->frameQueue.dequeue();
-		q->queueLock.unlock();
-		if (current.time < lastFrameTime) {
-			free((void *)current.data.data);
-			continue;
+		if (!holding) {
+			if (!pop(&current)) {
+				return WorkerPool::IDLE;
+			}
+			if (!accept(&current)) {
+				release(&current);
+				continue;
+			}
+			holding = true;
+			holdUntil = pace(&current);
 		}
-		if (current.noDrop) {
-			lastStartTime = os_gettime_ns() / 1000;
-			q->callback(&current.data);
-			lastFrameTime = current.time;
-			processingTime = os_gettime_ns() / 1000 - lastStartTime;
-		} else if (current.time - lastFrameTime + 15000 >
-			   processingTime) {
-			lastStartTime = os_gettime_ns() / 1000;
-			q->callback(&current.data);
-			lastFrameTime = current.time;
-			processingTime = os_gettime_ns() / 1000 - lastStartTime;
-		} else {
-			qDebug() << "dropped" << current.time - lastFrameTime
-				 << processingTime;
-		} // else we drop the frame
-		free((void *)current.data.data);
+		if (holdUntil > os_gettime_ns()) {
+			return holdUntil;
+		}
+		uint64_t start = os_gettime_ns() / 1000;
+		deliver(&current);
+		lastFrameTime = current.time;
+		processingTime = os_gettime_ns() / 1000 - start;
+		release(&current);
+		holding = false;
 	}
+	return WorkerPool::AGAIN;
 }
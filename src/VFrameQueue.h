@@ -18,39 +18,170 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 
 #ifndef OBS_SSP_VFRAMEQUEUE_H
 #define OBS_SSP_VFRAMEQUEUE_H
-#include <QQueue>
-#include <QAtomicInt>
-#include <QSemaphore>
-#include <QMutex>
+#include <atomic>
+#include <functional>
+#include <string>
 #include <imf/ISspClient.h>
-#include "pthread.h"
+#include "VFramePool.h"
+#include "WorkerPool.h"
 
-class VFrameQueue {
+// Slots in the ring, a power of two. Far more than a healthy decoder backlog.
+#define VFRAME_QUEUE_SIZE 64
+// How far a frame may lag the decoder before it is dropped, by default.
+#define VFRAME_DROP_SLACK_US 15000
+// Compressed bytes all running queues together may hold.
+#define VFRAME_QUEUE_BUDGET ((size_t)512 * 1024 * 1024)
+#define VFRAME_EVICT_LOG_INTERVAL_NS (5 * 1000000000ULL)
+// Playout buffer depth for paced (Normal latency) output, in frame intervals.
+#define VFRAME_JITTER_MIN 1
+#define VFRAME_JITTER_START 2
+#define VFRAME_JITTER_MAX 8
+// Frames played without an underrun before the depth shrinks again.
+#define VFRAME_JITTER_SHRINK_FRAMES 600
+// Frames decoded per turn on the shared workers before the next source's.
+#define VFRAME_TASK_BATCH 2
+
+/*
+ * Single producer (the client receive thread) / single consumer ring. The
+ * consumer is a task on the shared WorkerPool rather than a thread of its
+ * own: the producer posts it when a frame comes in, it decodes a few frames
+ * per run and goes idle once the ring is empty. Only one worker runs it at a
+ * time, so frames are still decoded in order.
+ *
+ * All running queues share VFRAME_QUEUE_BUDGET. Once it is used up, a queue
+ * holding more than its fair share (budget / running queues) evicts a GOP:
+ * the frames queued before the next IDR in the ring are discarded and new
+ * frames are refused up to the next IDR from the camera.
+ *
+ * With pacing on, the consumer also acts as a playout buffer: frames are
+ * handed to the decoder at the camera cadence, by pts, a few frame intervals
+ * behind arrival. That depth grows on underruns and shrinks slowly again.
+ */
+class VFrameQueue : WorkerPool::Task {
+	// Why the producer refuses frames up to the next IDR
+	enum Refusal {
+		REFUSE_NONE,
+		REFUSE_BUDGET,  // a GOP was evicted, counts in evicted()
+		REFUSE_DROP,    // a reference frame was dropped on enqueue
+		REFUSE_RESTART, // the stream changed
+	};
 	struct Frame {
 		imf::SspH264Data data;
 		uint64_t time;
+		uint64_t enqueued; // os_gettime_ns
 		bool noDrop;
+		bool reference;
+		uint16_t nalFlags;
+		uint32_t stream;
 	};
-	typedef std::function<void(imf::SspH264Data *)> CallbackFunc;
+	// buf holds data.data for the decoder, nullptr when it could not be
+	// wrapped. The callback owns that reference. nalFlags and stream as
+	// given to enqueue.
+	typedef std::function<void(imf::SspH264Data *, AVBufferRef *buf,
+				   uint16_t nalFlags, uint32_t stream)>
+		CallbackFunc;
 
 public:
 	VFrameQueue();
-	void enqueue(imf::SspH264Data, uint64_t time_us, bool noDrop);
+	~VFrameQueue() override;
+	// nalFlags are the frame's SSP_NAL_* flags, 0 when not known. stream
+	// is the producer's tag for the stream the frame belongs to.
+	void enqueue(imf::SspH264Data, uint64_t time_us, bool noDrop,
+		     bool reference = true, uint16_t nalFlags = 0,
+		     uint32_t stream = 0);
+	// Camera frame interval from the stream meta, 0 when unknown.
 	void setFrameTime(uint64_t time_us);
+	// Release frames at the camera cadence rather than on arrival.
+	void setPacing(bool enable) { pacing = enable; }
+	void setDropSlack(uint64_t slack_us) { dropSlack = slack_us; }
+	void setName(const std::string &n) { name = n; }
 	void setFrameCallback(CallbackFunc);
+	// Producer side: the stream changed, refuse frames up to its first IDR.
+	void restart() { refusing = REFUSE_RESTART; }
 	void start();
 	void stop();
+	// Frames waiting for the callback
+	uint32_t depth();
+	// Of those, frames beyond what the playout buffer is meant to hold
+	uint32_t backlog();
+	// Frames dropped for arriving late, out of order or on a full ring
+	uint64_t dropped() { return droppedFrames; }
+	// Of those, frames depending on a dropped reference frame
+	uint64_t skipped() { return skippedFrames; }
+	// Budget evictions and the frames they cost
+	uint64_t evictions() { return evictionCount; }
+	uint64_t evicted() { return evictedFrames; }
+	// Compressed bytes held by this queue and by all of them
+	size_t bytes() { return queuedBytes; }
+	static size_t totalBytes() { return budgetUsed; }
+	// Enqueue to callback latency since the last call, in microseconds.
+	void latency(uint64_t *avg_us, uint64_t *max_us);
+	VFramePool::Stats poolStats() { return pool->stats(); }
+	// Playout buffer: frames that came too late, bursts played out at
+	// once, and the current depth in frame intervals (0 when not pacing)
+	uint64_t underruns() { return underrunCount; }
+	uint64_t overruns() { return overrunCount; }
+	uint32_t jitterTarget() { return pacedTarget; }
+	// False when no other frame can reference this one (Annex B input).
+	static bool isReference(const uint8_t *data, size_t len, bool hevc);
 
 private:
-	static void run(VFrameQueue *q);
-	static void *pthread_run(void *q);
+	uint64_t run() override;
+	bool hasWork() override;
+	bool pop(Frame *frame);
+	bool accept(const Frame *frame);
+	void deliver(Frame *frame);
+	void release(Frame *frame);
+	uint64_t pace(Frame *frame);
+	void anchor(uint64_t pts_ns, uint64_t at_ns);
+	bool overBudget(size_t len);
+	void dropOnEnqueue(bool reference);
 	CallbackFunc callback;
-	QQueue<Frame> frameQueue;
-	QSemaphore sem;
-	QMutex queueLock;
-	pthread_t thread;
-	QAtomicInt running;
-	uint64_t maxTime;
+	std::string name;
+	VFramePool *pool;
+	Frame frames[VFRAME_QUEUE_SIZE];
+	alignas(64) std::atomic<uint32_t> head; // producer
+	alignas(64) std::atomic<uint32_t> tail; // consumer
+	WorkerPool *workers;
+	std::atomic<bool> running;
+	std::atomic<uint64_t> maxTime;
+	std::atomic<uint64_t> dropSlack;
+	std::atomic<uint64_t> droppedFrames;
+	std::atomic<uint64_t> skippedFrames;
+	std::atomic<uint64_t> latencySum;
+	std::atomic<uint64_t> latencyCount;
+	std::atomic<uint64_t> latencyMax;
+
+	static std::atomic<size_t> budgetUsed;
+	static std::atomic<uint32_t> runningQueues;
+	std::atomic<size_t> queuedBytes;
+	std::atomic<bool> evict;   // consumer: discard up to the next IDR
+	Refusal refusing;          // producer: refuse up to the next IDR
+	std::atomic<uint64_t> evictionCount;
+	std::atomic<uint64_t> evictedFrames;
+	uint64_t lastEvictLog;
+	uint64_t evictionsLogged;
+
+	std::atomic<bool> pacing;
+	std::atomic<uint32_t> pacedTarget;
+	std::atomic<uint64_t> underrunCount;
+	std::atomic<uint64_t> overrunCount;
+	// Consumer only: pts basePts plays at os_gettime_ns baseTime
+	bool anchored;
+	bool catchingUp;
+	uint64_t basePts;
+	uint64_t baseTime;
+	uint32_t target;
+	uint32_t sinceUnderrun;
+
+	// Consumer only, kept between runs
+	Frame current;
+	bool holding; // current is accepted, waiting for holdUntil
+	uint64_t holdUntil;
+	bool started;
+	bool skipToIdr;
+	uint64_t lastFrameTime;
+	uint64_t processingTime;
 };
 
 #endif //OBS_SSP_VFRAMEQUEUE_H
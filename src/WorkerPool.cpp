@@ -0,0 +1,267 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <obs.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include "obs-ssp.h"
+#include "WorkerPool.h"
+
+std::mutex WorkerPool::instanceLock;
+WorkerPool *WorkerPool::s_instance = nullptr;
+
+// Index of the worker running on this thread, -1 elsewhere
+static thread_local int currentWorker = -1;
+
+WorkerPool *WorkerPool::instance()
+{
+	std::lock_guard<std::mutex> lock(instanceLock);
+	if (!s_instance) {
+		int count = (int)std::thread::hardware_concurrency();
+		s_instance = new WorkerPool(count < 2 ? 2 : count);
+	}
+	return s_instance;
+}
+
+void WorkerPool::destroyInstance()
+{
+	std::lock_guard<std::mutex> lock(instanceLock);
+	delete s_instance;
+	s_instance = nullptr;
+}
+
+WorkerPool::WorkerPool(int count)
+{
+	nextHome = 0;
+	sleepers = 0;
+	stopping = false;
+	nextTimer = UINT64_MAX;
+	runs = 0;
+	steals = 0;
+	timed = 0;
+	sleeps = 0;
+	for (int i = 0; i < count; ++i) {
+		workers.emplace_back(new Worker);
+	}
+	// All deques exist before any worker looks at them
+	for (int i = 0; i < count; ++i) {
+		workers[i]->thread = std::thread(&WorkerPool::loop, this, i);
+	}
+	ssp_blog(LOG_INFO, "decode pool started with %d workers", count);
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(idleLock);
+		stopping = true;
+	}
+	idleCond.notify_all();
+	for (auto &w : workers) {
+		w->thread.join();
+	}
+}
+
+void WorkerPool::push(int index, Task *task)
+{
+	{
+		std::lock_guard<std::mutex> lock(workers[index]->lock);
+		workers[index]->tasks.push_back(task);
+	}
+	if (sleepers.load(std::memory_order_seq_cst)) {
+		std::lock_guard<std::mutex> lock(idleLock);
+		idleCond.notify_one();
+	}
+}
+
+void WorkerPool::post(Task *task)
+{
+	if (task->scheduled.exchange(true)) {
+		return;
+	}
+	if (task->home < 0) {
+		task->home = (int)(nextHome++ % workers.size());
+	}
+	push(currentWorker >= 0 ? currentWorker : task->home, task);
+}
+
+WorkerPool::Task *WorkerPool::take(int index)
+{
+	std::lock_guard<std::mutex> lock(workers[index]->lock);
+	auto &tasks = workers[index]->tasks;
+	if (tasks.empty()) {
+		return nullptr;
+	}
+	Task *task = tasks.front();
+	tasks.pop_front();
+	return task;
+}
+
+WorkerPool::Task *WorkerPool::steal(int index)
+{
+	size_t count = workers.size();
+	for (size_t i = 1; i < count; ++i) {
+		auto &w = workers[(index + i) % count];
+		std::lock_guard<std::mutex> lock(w->lock);
+		if (!w->tasks.empty()) {
+			Task *task = w->tasks.back();
+			w->tasks.pop_back();
+			steals++;
+			return task;
+		}
+	}
+	return nullptr;
+}
+
+// Moves the tasks whose deadline passed to this worker's deque.
+void WorkerPool::popTimers(int index)
+{
+	uint64_t now = os_gettime_ns();
+	if (now < nextTimer) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(idleLock);
+	while (!timers.empty() && timers.begin()->first <= now) {
+		Task *task = timers.begin()->second;
+		timers.erase(timers.begin());
+		timed++;
+		std::lock_guard<std::mutex> wlock(workers[index]->lock);
+		workers[index]->tasks.push_back(task);
+	}
+	nextTimer = timers.empty() ? UINT64_MAX : timers.begin()->first;
+}
+
+/*
+ * Sleeps until there is a task anywhere or a deadline passes, nullptr once
+ * the pool is stopping. sleepers goes up before the deques are checked
+ * again, push checks it after queueing, so a wakeup cannot get lost.
+ */
+WorkerPool::Task *WorkerPool::wait(int index)
+{
+	std::unique_lock<std::mutex> lock(idleLock);
+	sleepers++;
+	while (!stopping) {
+		for (size_t i = 0; i < workers.size(); ++i) {
+			auto &w = workers[(index + i) % workers.size()];
+			std::lock_guard<std::mutex> wlock(w->lock);
+			if (!w->tasks.empty()) {
+				Task *task = w->tasks.front();
+				w->tasks.pop_front();
+				sleepers--;
+				return task;
+			}
+		}
+		uint64_t now = os_gettime_ns();
+		if (!timers.empty() && timers.begin()->first <= now) {
+			Task *task = timers.begin()->second;
+			timers.erase(timers.begin());
+			nextTimer = timers.empty() ? UINT64_MAX
+						   : timers.begin()->first;
+			timed++;
+			sleepers--;
+			return task;
+		}
+		sleeps++;
+		if (timers.empty()) {
+			idleCond.wait(lock);
+		} else {
+			idleCond.wait_for(lock,
+					  std::chrono::nanoseconds(
+						  timers.begin()->first - now));
+		}
+	}
+	sleepers--;
+	return nullptr;
+}
+
+void WorkerPool::loop(int index)
+{
+	os_set_thread_name("ssp-decode");
+	currentWorker = index;
+	while (true) {
+		popTimers(index);
+		Task *task = take(index);
+		if (!task) {
+			task = steal(index);
+		}
+		if (!task) {
+			task = wait(index);
+		}
+		if (!task) {
+			break;
+		}
+
+		runs++;
+		task->busy++;
+		uint64_t next = task->run();
+		if (next == AGAIN) {
+			push(index, task);
+		} else if (next != IDLE) {
+			std::lock_guard<std::mutex> lock(idleLock);
+			timers.emplace(next, task);
+			if (next < nextTimer) {
+				nextTimer = next;
+			}
+			// A sleeping worker may be waiting for a later deadline
+			idleCond.notify_one();
+		} else {
+			task->scheduled.store(false, std::memory_order_seq_cst);
+			if (task->hasWork()) {
+				post(task);
+			}
+		}
+		task->busy--;
+	}
+	currentWorker = -1;
+}
+
+void WorkerPool::cancel(Task *task)
+{
+	while (task->scheduled || task->busy) {
+		// Run a waiting task now rather than at its deadline
+		bool found = false;
+		{
+			std::lock_guard<std::mutex> lock(idleLock);
+			for (auto it = timers.begin(); it != timers.end();) {
+				if (it->second == task) {
+					it = timers.erase(it);
+					found = true;
+				} else {
+					++it;
+				}
+			}
+			nextTimer = timers.empty() ? UINT64_MAX
+						   : timers.begin()->first;
+		}
+		if (found) {
+			push(task->home, task);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+WorkerPool::Stats WorkerPool::stats()
+{
+	Stats s;
+	s.workers = (uint32_t)workers.size();
+	s.runs = runs;
+	s.steals = steals;
+	s.timed = timed;
+	s.sleeps = sleeps;
+	return s;
+}
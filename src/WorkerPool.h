@@ -0,0 +1,116 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_WORKERPOOL_H
+#define OBS_SSP_WORKERPOOL_H
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Decode workers shared by all sources, one thread per core.
+ *
+ * Each worker has its own deque. A task posted from outside goes to its home
+ * worker, a task that asks to run again goes to the back of the deque of the
+ * worker that ran it, and an idle worker steals from the back of the others.
+ * A task is never queued twice and never runs on two workers at once, so
+ * whatever it does stays in order. It should do a bounded amount of work per
+ * run and ask to run again, that keeps the latency of the other tasks down.
+ */
+class WorkerPool {
+public:
+	// Returned by Task::run, anything larger is an os_gettime_ns deadline
+	static const uint64_t IDLE = 0;
+	static const uint64_t AGAIN = 1;
+
+	class Task {
+	public:
+		virtual ~Task() = default;
+		// IDLE, AGAIN, or when to run next
+		virtual uint64_t run() = 0;
+		// Checked after going idle, catches work posted meanwhile
+		virtual bool hasWork() = 0;
+
+	private:
+		friend class WorkerPool;
+		std::atomic<bool> scheduled{false};
+		std::atomic<int> busy{0};
+		int home = -1;
+	};
+
+	struct Stats {
+		uint32_t workers;
+		uint64_t runs;
+		uint64_t steals;
+		uint64_t timed;
+		uint64_t sleeps; // times a worker found nothing to do
+	};
+
+	static WorkerPool *instance();
+	static void destroyInstance();
+
+	// Queues the task unless it is queued or running already.
+	void post(Task *task);
+	// Waits until the task is neither queued nor running. The task must
+	// have stopped posting itself, and its hasWork must return false.
+	void cancel(Task *task);
+	Stats stats();
+
+private:
+	struct Worker {
+		std::mutex lock;
+		std::deque<Task *> tasks;
+		std::thread thread;
+	};
+
+	explicit WorkerPool(int count);
+	~WorkerPool();
+	void push(int index, Task *task);
+	Task *take(int index);
+	Task *steal(int index);
+	Task *wait(int index);
+	void popTimers(int index);
+	void loop(int index);
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::atomic<uint32_t> nextHome;
+
+	std::mutex idleLock;
+	std::condition_variable idleCond;
+	std::atomic<uint32_t> sleepers;
+	bool stopping;
+	// Tasks waiting for a deadline, under idleLock
+	std::multimap<uint64_t, Task *> timers;
+	std::atomic<uint64_t> nextTimer;
+
+	std::atomic<uint64_t> runs;
+	std::atomic<uint64_t> steals;
+	std::atomic<uint64_t> timed;
+	std::atomic<uint64_t> sleeps;
+
+	static std::mutex instanceLock;
+	static WorkerPool *s_instance;
+};
+
+#endif //OBS_SSP_WORKERPOOL_H
@@ -67,7 +67,8 @@ static void init_hw_decoder(struct ffmpeg_decode *d)
 }
 
 int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id,
-		       bool use_hw)
+		       bool use_hw, enum ffmpeg_decode_profile profile,
+		       int threads)
 {
 	int ret;
 
@@ -79,12 +80,27 @@ int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id,
 
 	decode->decoder = avcodec_alloc_context3(decode->codec);
 
-	decode->decoder->thread_count = 0;
+	decode->decoder->thread_count = threads;
 	decode->decoder->delay = 0;
+	decode->profile = profile;
+	decode->threads = threads;
+
+	if (profile != FFMPEG_DECODE_THROUGHPUT) {
+		decode->decoder->thread_type = FF_THREAD_SLICE;
+		decode->decoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		if (profile == FFMPEG_DECODE_LOW_LATENCY_FAST)
+			decode->decoder->flags2 |= AV_CODEC_FLAG2_FAST;
+	}
 
 	if (use_hw)
 		init_hw_decoder(decode);
 
+	decode->packet = av_packet_alloc();
+	if (!decode->packet) {
+		ffmpeg_decode_free(decode);
+		return AVERROR(ENOMEM);
+	}
+
 	ret = avcodec_open2(decode->decoder, decode->codec, NULL);
 	if (ret < 0) {
 		ffmpeg_decode_free(decode);
@@ -108,12 +124,22 @@ void ffmpeg_decode_free(struct ffmpeg_decode *decode)
 	if (decode->hw_device_ctx)
 		av_buffer_unref(&decode->hw_device_ctx);
 
+	if (decode->packet)
+		av_packet_free(&decode->packet);
+
 	if (decode->packet_buffer)
 		bfree(decode->packet_buffer);
 
 	memset(decode, 0, sizeof(*decode));
 }
 
+void ffmpeg_decode_flush(struct ffmpeg_decode *decode)
+{
+	if (decode->decoder)
+		avcodec_flush_buffers(decode->decoder);
+	decode->draining = false;
+}
+
 static inline enum video_format convert_pixel_format(int f)
 {
 	switch (f) {
@@ -224,8 +250,6 @@ bool ffmpeg_decode_audio(struct ffmpeg_decode *decode, uint8_t *data,
 
 	*got_output = false;
 
-	copy_data(decode, data, size);
-
 	if (!decode->frame) {
 		decode->frame = av_frame_alloc();
 		if (!decode->frame)
@@ -233,13 +257,14 @@ bool ffmpeg_decode_audio(struct ffmpeg_decode *decode, uint8_t *data,
 	}
 
 	if (data && size) {
-		AVPacket *packet = av_packet_alloc();
+		AVPacket *packet = decode->packet;
+		copy_data(decode, data, size);
 		packet->data = decode->packet_buffer;
 		packet->size = (int)size;
 
 		ret = avcodec_send_packet(decode->decoder, packet);
 
-		av_packet_free(&packet);
+		av_packet_unref(packet);
 	}
 	if (ret == 0)
 		ret = avcodec_receive_frame(decode->decoder, decode->frame);
@@ -296,58 +321,115 @@ convert_color_space(enum AVColorSpace s, enum AVColorTransferCharacteristic trc,
 	}
 }
 
-bool ffmpeg_decode_video(struct ffmpeg_decode *decode, uint8_t *data,
-			 size_t size, long long *ts, enum video_colorspace cs,
+static bool output_video(struct ffmpeg_decode *decode, AVFrame *out_frame,
+			 int ret, long long *ts, enum video_colorspace cs,
 			 enum video_range_type range,
+			 struct obs_source_frame2 *frame, bool *got_output);
+
+bool ffmpeg_decode_video(struct ffmpeg_decode *decode, uint8_t *data,
+			 size_t size, AVBufferRef *buf, int keyframe,
+			 long long *ts,
+			 enum video_colorspace cs, enum video_range_type range,
 			 struct obs_source_frame2 *frame, bool *got_output)
 {
-	int got_frame = false;
+	AVPacket *packet = decode->packet;
 	AVFrame *out_frame;
 	int ret;
 
 	*got_output = false;
 
-	copy_data(decode, data, size);
-
 	if (!decode->frame) {
 		decode->frame = av_frame_alloc();
-		if (!decode->frame)
+		if (!decode->frame) {
+			av_buffer_unref(&buf);
 			return false;
+		}
 
 		if (decode->hw && !decode->hw_frame) {
 			decode->hw_frame = av_frame_alloc();
-			if (!decode->hw_frame)
+			if (!decode->hw_frame) {
+				av_buffer_unref(&buf);
 				return false;
+			}
 		}
 	}
 
 	out_frame = decode->hw ? decode->hw_frame : decode->frame;
 
-	AVPacket *packet = av_packet_alloc();
-	packet->data = decode->packet_buffer;
+	/* A packet without buf would be copied by libavcodec once more */
+	if (buf) {
+		packet->buf = buf;
+		packet->data = data;
+	} else {
+		copy_data(decode, data, size);
+		packet->data = decode->packet_buffer;
+	}
 	packet->size = (int)size;
 	packet->pts = *ts;
 
-	switch (decode->codec->id) {
-	case AV_CODEC_ID_H264:
-		if (obs_avc_keyframe(data, size))
-			packet->flags |= AV_PKT_FLAG_KEY;
+	if (keyframe < 0) {
+		switch (decode->codec->id) {
+		case AV_CODEC_ID_H264:
+			keyframe = obs_avc_keyframe(data, size);
 #ifdef ENABLE_HEVC
-		break;
-	case AV_CODEC_ID_HEVC:
-		if (obs_hevc_keyframe(data, size))
-			packet->flags |= AV_PKT_FLAG_KEY;
+			break;
+		case AV_CODEC_ID_HEVC:
+			keyframe = obs_hevc_keyframe(data, size);
 #endif
+			break;
+		default:
+			break;
+		}
 	}
+	if (keyframe > 0)
+		packet->flags |= AV_PKT_FLAG_KEY;
 
 	ret = avcodec_send_packet(decode->decoder, packet);
 	if (ret == 0) {
 		ret = avcodec_receive_frame(decode->decoder, out_frame);
 	}
 
-	av_packet_free(&packet);
+	av_packet_unref(packet);
 
-	got_frame = (ret == 0);
+	return output_video(decode, out_frame, ret, ts, cs, range, frame,
+			    got_output);
+}
+
+bool ffmpeg_decode_video_drain(struct ffmpeg_decode *decode, long long *ts,
+			       enum video_colorspace cs,
+			       enum video_range_type range,
+			       struct obs_source_frame2 *frame,
+			       bool *got_output)
+{
+	AVFrame *out_frame;
+	int ret;
+
+	*got_output = false;
+
+	if (!decode->frame)
+		return true;
+
+	out_frame = decode->hw ? decode->hw_frame : decode->frame;
+
+	if (!decode->draining) {
+		decode->draining = true;
+		ret = avcodec_send_packet(decode->decoder, NULL);
+		if (ret < 0 && ret != AVERROR_EOF)
+			return false;
+	}
+
+	ret = avcodec_receive_frame(decode->decoder, out_frame);
+	return output_video(decode, out_frame, ret, ts, cs, range, frame,
+			    got_output);
+}
+
+/* ret is what avcodec_receive_frame returned for out_frame. */
+static bool output_video(struct ffmpeg_decode *decode, AVFrame *out_frame,
+			 int ret, long long *ts, enum video_colorspace cs,
+			 enum video_range_type range,
+			 struct obs_source_frame2 *frame, bool *got_output)
+{
+	bool got_frame = (ret == 0);
 
 	if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
 		ret = 0;
@@ -357,7 +439,7 @@ bool ffmpeg_decode_video(struct ffmpeg_decode *decode, uint8_t *data,
 	else if (!got_frame)
 		return true;
 
-	if (got_frame && decode->hw) {
+	if (decode->hw) {
 		ret = av_hwframe_transfer_data(decode->frame, out_frame, 0);
 		if (ret < 0) {
 			return false;
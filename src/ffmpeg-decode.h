@@ -36,6 +36,15 @@ extern "C" {
 #pragma warning(pop)
 #endif
 
+/* Frame threads add a frame of delay each, slice threads (WPP for HEVC)
+ * none, but they only scale with the slices the encoder emits. */
+enum ffmpeg_decode_profile {
+	FFMPEG_DECODE_THROUGHPUT,
+	FFMPEG_DECODE_LOW_LATENCY,
+	/* Low latency plus AV_CODEC_FLAG2_FAST, not bit exact */
+	FFMPEG_DECODE_LOW_LATENCY_FAST,
+};
+
 struct ffmpeg_decode {
 	AVBufferRef *hw_device_ctx;
 	AVCodecContext *decoder;
@@ -44,26 +53,48 @@ struct ffmpeg_decode {
 	AVFrame *hw_frame;
 	AVFrame *frame;
 	bool hw;
+	enum ffmpeg_decode_profile profile;
+	int threads;
+	bool draining;
 
+	AVPacket *packet;
 	uint8_t *packet_buffer;
 	size_t packet_size;
 };
 
+/* threads is the decoder's thread_count, 0 lets libavcodec pick one per
+ * core. */
 extern int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id,
-			      bool use_hw);
+			      bool use_hw, enum ffmpeg_decode_profile profile,
+			      int threads);
 extern void ffmpeg_decode_free(struct ffmpeg_decode *decode);
+/* Drops buffered frames and references, keeps the parameter sets. */
+extern void ffmpeg_decode_flush(struct ffmpeg_decode *decode);
 
 extern bool ffmpeg_decode_audio(struct ffmpeg_decode *decode, uint8_t *data,
 				size_t size, struct obs_source_audio *audio,
 				bool *got_output);
 
+/* When buf is not NULL, data lies in it and is followed by
+ * INPUT_BUFFER_PADDING_SIZE zeroed bytes. It is then handed to the decoder
+ * without a copy, and the reference passed in is consumed either way. */
+/* keyframe is 1 or 0 when the caller knows, -1 to look in data. */
 extern bool ffmpeg_decode_video(struct ffmpeg_decode *decode, uint8_t *data,
-				size_t size, long long *ts,
+				size_t size, AVBufferRef *buf, int keyframe,
+				long long *ts,
 				enum video_colorspace cs,
 				enum video_range_type range,
 				struct obs_source_frame2 *frame,
 				bool *got_output);
 
+/* Returns the frames the decoder still holds, one per call until
+ * got_output is false. It takes no more packets after the first call. */
+extern bool ffmpeg_decode_video_drain(struct ffmpeg_decode *decode,
+				      long long *ts, enum video_colorspace cs,
+				      enum video_range_type range,
+				      struct obs_source_frame2 *frame,
+				      bool *got_output);
+
 static inline bool ffmpeg_decode_valid(struct ffmpeg_decode *decode)
 {
 	return decode->decoder != NULL;
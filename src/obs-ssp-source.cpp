@@ -45,7 +45,10 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 
 #include "ssp-controller.h"
 #include "ssp-client-iso.h"
+#include "ssp-client-inproc.h"
 #include "VFrameQueue.h"
+#include "AFrameQueue.h"
+#include "DecodeBudget.h"
 
 extern "C" {
 #include "ffmpeg-decode.h"
@@ -57,6 +60,7 @@ extern "C" {
 
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #define PROP_SOURCE_IP "ssp_source_ip"
 #define PROP_CUSTOM_SOURCE_IP "ssp_custom_source_ip"
@@ -70,6 +74,13 @@ extern "C" {
 #define PROP_LATENCY "latency"
 #define PROP_VIDEO_RANGE "video_range"
 #define PROP_EXP_WAIT_I "exp_wait_i_frame"
+#define PROP_SHM "ssp_ipc_shm"
+#define PROP_CLIENT_MODE "ssp_client_mode"
+#define PROP_BANDWIDTH "ssp_bandwidth"
+#define PROP_PAUSE_HIDDEN "ssp_pause_hidden"
+#define PROP_DROP_SLACK "ssp_drop_slack"
+#define PROP_FAST_DECODE "ssp_fast_decode"
+#define PROP_STATS "ssp_stats"
 
 #define PROP_BW_HIGHEST 0
 #define PROP_BW_LOWEST 1
@@ -81,6 +92,10 @@ extern "C" {
 #define PROP_LATENCY_NORMAL 0
 #define PROP_LATENCY_LOW 1
 
+#define PROP_CLIENT_ISOLATED 0
+#define PROP_CLIENT_INPROC 1
+#define PROP_CLIENT_SHARED 2
+
 #define PROP_LED_TALLY "led_as_tally_light"
 #define PROP_RESOLUTION "ssp_resolution"
 #define PROP_FRAME_RATE "ssp_frame_rate"
@@ -95,25 +110,59 @@ extern "C" {
 
 using namespace std::placeholders;
 
+// Frames a decoder may hold before output, frame threads hold one each.
+#define DECODE_INFLIGHT 64
+
 struct ssp_source;
 
+// Decode-in to frame-out time, matched on pts. Decode thread only but the
+// totals, which the stats read.
+struct ssp_decode_timing {
+	int64_t pts[DECODE_INFLIGHT];
+	uint64_t sent[DECODE_INFLIGHT];
+	uint32_t next;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> max;
+};
+
+struct ssp_audio_format {
+	AVCodecID codec;
+	uint32_t sample_rate;
+	uint32_t sample_size;
+	uint32_t channels;
+};
+
 struct ssp_connection {
-	SSPClientIso *client;
+	SSPClient *client;
 	ffmpeg_decode vdecoder;
-	uint32_t width;
-	uint32_t height;
-	AVCodecID vformat;
+	// From the stream meta. stream counts switches, frames carry the
+	// count they were received under through the queue.
+	std::atomic<uint32_t> width;
+	std::atomic<uint32_t> height;
+	std::atomic<AVCodecID> vformat;
+	std::atomic<uint32_t> stream;
+	uint32_t vdecoder_stream; // stream the open vdecoder was opened for
 	obs_source_frame2 frame;
+	ssp_decode_timing vtiming;
+	// Set by a reconnect until its first frame is out
+	std::atomic<uint64_t> reconnect_time;
+	bool reconnect_warm;
 
 	ffmpeg_decode adecoder;
-	uint32_t sample_size;
-	AVCodecID aformat;
+	// Written by the meta on the receive thread, the audio thread works
+	// on a copy taken per packet
+	std::mutex aformat_lock;
+	ssp_audio_format aformat;
 	obs_source_audio audio;
+	std::vector<int32_t> pcm_buffer; // audio thread, widened 24 bit PCM
 
 	VFrameQueue *queue;
+	AFrameQueue *aqueue;
 	std::atomic<bool> running;
 	int i_frame_shown;
 	std::atomic<int> reconnect_attempt;
+	std::atomic<uint32_t> recv_buffer_full;
 
 	// copy from ssp_source
 	char *source_ip;
@@ -121,6 +170,14 @@ struct ssp_connection {
 	int bitrate;
 	int wait_i_frame;
 	int sync_mode;
+	bool shm;
+	int client_mode;
+	std::atomic<int> bandwidth;
+	std::atomic<bool> pause_hidden;
+	std::atomic<bool> hidden;
+	std::atomic<int> drop_slack; // ms
+	std::atomic<int> latency;
+	std::atomic<bool> fast_decode;
 	obs_source_t *source;
 	// not used
 	int video_range;
@@ -138,6 +195,14 @@ struct ssp_source {
 	int bitrate;
 	int wait_i_frame;
 	int tally;
+	bool shm;
+	int client_mode;
+	int bandwidth;
+	bool pause_hidden;
+	bool hidden;
+	int drop_slack;
+	int latency;
+	bool fast_decode;
 
 	bool do_check;
 	bool no_check;
@@ -181,7 +246,7 @@ static void ssp_start(ssp_source *s);
 void *thread_ssp_reconnect(void *data);
 
 static void ssp_video_data_enqueue(struct imf::SspH264Data *video,
-				   ssp_connection *s)
+				   const NalIndex *index, ssp_connection *s)
 {
 	if (!s->running) {
 		return;
@@ -189,63 +254,321 @@ static void ssp_video_data_enqueue(struct imf::SspH264Data *video,
 	if (!s->queue) {
 		return;
 	}
-	s->queue->enqueue(*video, video->pts, video->type == 5);
+	// The connector indexed the frame already, scan it only without
+	uint16_t nal_flags = index ? index->flags : 0;
+	bool reference;
+	if (nal_flags & SSP_NAL_INDEXED) {
+		reference = nal_flags & SSP_NAL_REFERENCE;
+	} else {
+		reference = VFrameQueue::isReference(
+			video->data, video->len,
+			s->vformat == AV_CODEC_ID_HEVC);
+	}
+	s->queue->enqueue(*video, video->pts, video->type == 5, reference,
+			  nal_flags, s->stream);
+	// Lets the sender shed P-frames before the decoder falls further behind
+	if (s->client) {
+		s->client->ReportQueueDepth(s->queue->backlog());
+	}
+}
+
+// Receive thread side, decoding happens on the audio queue's thread.
+static void ssp_audio_data_enqueue(struct imf::SspAudioData *audio,
+				   ssp_connection *s)
+{
+	if (!s->running || !s->aqueue) {
+		return;
+	}
+	s->aqueue->enqueue(audio);
 }
 
-static void ssp_on_video_data(struct imf::SspH264Data *video, ssp_connection *s)
+// Low latency trades the decoder's frame threads for slice threads.
+static ffmpeg_decode_profile ssp_decode_profile(ssp_connection *s)
+{
+	if (s->latency != PROP_LATENCY_LOW) {
+		return FFMPEG_DECODE_THROUGHPUT;
+	}
+	return s->fast_decode ? FFMPEG_DECODE_LOW_LATENCY_FAST
+			      : FFMPEG_DECODE_LOW_LATENCY;
+}
+
+static const char *ssp_decode_profile_name(ffmpeg_decode_profile profile)
+{
+	switch (profile) {
+	case FFMPEG_DECODE_LOW_LATENCY:
+		return "low latency";
+	case FFMPEG_DECODE_LOW_LATENCY_FAST:
+		return "low latency, fast";
+	default:
+		return "throughput";
+	}
+}
+
+static void decode_timing_in(ssp_decode_timing *t, int64_t pts)
+{
+	uint32_t i = t->next++ % DECODE_INFLIGHT;
+	t->pts[i] = pts;
+	t->sent[i] = os_gettime_ns();
+}
+
+static void decode_timing_out(ssp_decode_timing *t, int64_t pts)
+{
+	// Newest first, output lags input by a few frames at most
+	for (uint32_t n = 1; n <= DECODE_INFLIGHT && n <= t->next; ++n) {
+		uint32_t i = (t->next - n) % DECODE_INFLIGHT;
+		if (t->pts[i] != pts || !t->sent[i]) {
+			continue;
+		}
+		uint64_t took = os_gettime_ns() - t->sent[i];
+		t->sent[i] = 0;
+		t->sum += took;
+		t->count++;
+		if (took > t->max) {
+			t->max = took;
+		}
+		return;
+	}
+}
+
+// pts is the frame's in microseconds, for the camera clock sync modes.
+static void ssp_output_video(ssp_connection *s, int64_t pts)
+{
+	uint64_t reconnected = s->reconnect_time.exchange(0);
+	if (reconnected) {
+		ssp_blog(LOG_INFO,
+			 "%s first frame %llu ms after reconnecting, "
+			 "%s decoder",
+			 s->source_ip,
+			 (unsigned long long)(os_gettime_ns() - reconnected) /
+				 1000000,
+			 s->reconnect_warm ? "kept" : "new");
+	}
+	if (s->sync_mode == PROP_SYNC_INTERNAL) {
+		s->frame.timestamp = os_gettime_ns();
+	} else {
+		s->frame.timestamp = (uint64_t)pts * 1000;
+	}
+	//        if (flip)
+	//            frame.flip = !frame.flip;
+	obs_source_output_video2(s->source, &s->frame);
+}
+
+/*
+ * Frees the video decoder, showing the frames it still holds first: with
+ * frame threads it is several behind, dropping them would stall the
+ * picture for as long.
+ */
+static void ssp_close_video_decoder(ssp_connection *s)
+{
+	bool got_output = true;
+	while (got_output) {
+		long long ts = 0;
+		if (!ffmpeg_decode_video_drain(&s->vdecoder, &ts,
+					       VIDEO_CS_DEFAULT,
+					       VIDEO_RANGE_PARTIAL, &s->frame,
+					       &got_output)) {
+			break;
+		}
+		if (got_output) {
+			decode_timing_out(&s->vtiming, ts);
+			ssp_output_video(s, ts);
+		}
+	}
+	ffmpeg_decode_free(&s->vdecoder);
+}
+
+static void ssp_on_video_data(struct imf::SspH264Data *video, AVBufferRef *buf,
+			      uint16_t nal_flags, uint32_t stream,
+			      ssp_connection *s)
 {
 	if (!s->running) {
+		av_buffer_unref(&buf);
 		return;
 	}
+	bool indexed = nal_flags & SSP_NAL_INDEXED;
+	// A new decoder can only start on an IDR carrying its parameter sets
+	bool restart_point = video->type == 5 &&
+			     (!indexed || (nal_flags & SSP_NAL_PARAM_SETS));
+	ffmpeg_decode_profile profile = ssp_decode_profile(s);
+	int threads = DecodeBudget::instance()->threads(s);
+	if (ffmpeg_decode_valid(&s->vdecoder) && s->vdecoder_stream != stream) {
+		// First frame of a new stream, an IDR: ssp_on_meta_data has the
+		// queue refuse anything before it. Frames of the old stream
+		// still queued went to the old decoder.
+		ssp_blog(LOG_INFO,
+			 "%s video stream changed to %s %ux%u, new decoder",
+			 s->source_ip,
+			 s->vformat == AV_CODEC_ID_HEVC ? "H.265" : "H.264",
+			 (uint32_t)s->width, (uint32_t)s->height);
+		ssp_close_video_decoder(s);
+		s->reconnect_warm = false;
+	} else if (ffmpeg_decode_valid(&s->vdecoder) &&
+		   s->vdecoder.profile != profile && restart_point) {
+		// Threading is fixed once the decoder is open, the new one
+		// starts on an IDR so it needs nothing from the old one
+		ssp_blog(LOG_INFO, "%s video decoder switching to %s",
+			 s->source_ip, ssp_decode_profile_name(profile));
+		ssp_close_video_decoder(s);
+	} else if (ffmpeg_decode_valid(&s->vdecoder) &&
+		   DecodeBudget::reopen(s->vdecoder.threads, threads) &&
+		   restart_point) {
+		// New thread share, an IDR needs nothing from the old decoder
+		ssp_blog(LOG_INFO, "%s video decoder moving to %d threads",
+			 s->source_ip, threads);
+		ssp_close_video_decoder(s);
+	}
 	if (!ffmpeg_decode_valid(&s->vdecoder)) {
 		assert(s->vformat == AV_CODEC_ID_H264 ||
 		       s->vformat == AV_CODEC_ID_HEVC);
-		if (ffmpeg_decode_init(&s->vdecoder, s->vformat, s->hwaccel) <
-		    0) {
+		if (ffmpeg_decode_init(&s->vdecoder, s->vformat, s->hwaccel,
+				       profile, threads) < 0) {
 			ssp_blog(LOG_WARNING,
 				 "Could not initialize video decoder");
+			av_buffer_unref(&buf);
 			return;
 		}
+		s->vdecoder_stream = stream;
 	}
 	if (s->wait_i_frame && !s->i_frame_shown) {
 		if (video->type == 5) {
 			s->i_frame_shown = true;
 		} else {
+			av_buffer_unref(&buf);
 			return;
 		}
 	}
 
 	int64_t ts = video->pts;
 	bool got_output;
-	bool success = ffmpeg_decode_video(&s->vdecoder, video->data,
-					   video->len, &ts, VIDEO_CS_DEFAULT,
-					   VIDEO_RANGE_PARTIAL, &s->frame,
-					   &got_output);
+	decode_timing_in(&s->vtiming, ts);
+	int keyframe = indexed ? (nal_flags & SSP_NAL_KEYFRAME) != 0 : -1;
+	bool success = ffmpeg_decode_video(
+		&s->vdecoder, video->data, video->len, buf, keyframe, &ts,
+		VIDEO_CS_DEFAULT, VIDEO_RANGE_PARTIAL, &s->frame, &got_output);
 	if (!success) {
 		ssp_blog(LOG_WARNING, "Error decoding video");
 		return;
 	}
 
 	if (got_output) {
-		if (s->sync_mode == PROP_SYNC_INTERNAL) {
-			s->frame.timestamp = os_gettime_ns();
-		} else {
-			s->frame.timestamp = (uint64_t)video->pts * 1000;
-		}
-		//        if (flip)
-		//            frame.flip = !frame.flip;
-		obs_source_output_video2(s->source, &s->frame);
+		decode_timing_out(&s->vtiming, ts);
+		ssp_output_video(s, video->pts);
+	}
+}
+
+// Bytes per sample of the PCM formats OBS takes without a decoder, else 0.
+static uint32_t ssp_pcm_bytes(AVCodecID format)
+{
+	switch (format) {
+	case AV_CODEC_ID_PCM_S16LE:
+		return 2;
+	case AV_CODEC_ID_PCM_S24LE:
+		return 3;
+	case AV_CODEC_ID_PCM_S32LE:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+// PCM format for a sample width in bits, AV_CODEC_ID_NONE for the others.
+static AVCodecID ssp_pcm_format(uint32_t bits)
+{
+	switch (bits) {
+	case 16:
+		return AV_CODEC_ID_PCM_S16LE;
+	case 24:
+		return AV_CODEC_ID_PCM_S24LE;
+	case 32:
+		return AV_CODEC_ID_PCM_S32LE;
+	default:
+		return AV_CODEC_ID_NONE;
+	}
+}
+
+// speaker_layout values are channel counts, there is none for 7.
+static speaker_layout ssp_pcm_speakers(uint32_t channels)
+{
+	if (!channels || channels == 7 || channels > 8) {
+		return SPEAKERS_UNKNOWN;
+	}
+	return (speaker_layout)channels;
+}
+
+// OBS has no 24 bit format, the samples go to the top of 32 bit ones.
+static void ssp_pcm_widen24(const uint8_t *in, int32_t *out, size_t samples)
+{
+	for (size_t i = 0; i < samples; ++i, in += 3) {
+		uint32_t v = (uint32_t)in[0] << 8 | (uint32_t)in[1] << 16 |
+			     (uint32_t)in[2] << 24;
+		out[i] = (int32_t)v;
 	}
 }
 
+/*
+ * Interleaved little-endian PCM is handed to OBS as the camera sent it,
+ * only 24 bit samples need widening on the way.
+ */
+static void ssp_on_pcm_data(struct imf::SspAudioData *audio, uint32_t bytes,
+			    uint32_t channels, ssp_connection *s)
+{
+	speaker_layout speakers = ssp_pcm_speakers(channels);
+	if (speakers == SPEAKERS_UNKNOWN) {
+		return;
+	}
+	size_t samples = audio->len / bytes;
+	size_t frames = samples / channels;
+	if (!frames) {
+		return;
+	}
+	memset(s->audio.data, 0, sizeof(s->audio.data));
+	if (bytes == 3) {
+		s->pcm_buffer.resize(samples);
+		ssp_pcm_widen24(audio->data, s->pcm_buffer.data(), samples);
+		s->audio.data[0] = (uint8_t *)s->pcm_buffer.data();
+	} else {
+		s->audio.data[0] = audio->data;
+	}
+	s->audio.format = bytes == 2 ? AUDIO_FORMAT_16BIT : AUDIO_FORMAT_32BIT;
+	s->audio.speakers = speakers;
+	s->audio.frames = (uint32_t)frames;
+	if (s->sync_mode == PROP_SYNC_INTERNAL) {
+		s->audio.timestamp = os_gettime_ns();
+	} else {
+		s->audio.timestamp = (uint64_t)audio->pts * 1000;
+	}
+	if (s->running)
+		obs_source_output_audio(s->source, &s->audio);
+}
+
 static void ssp_on_audio_data(struct imf::SspAudioData *audio,
 			      ssp_connection *s)
 {
 	if (!s->running) {
 		return;
 	}
+	ssp_audio_format format;
+	{
+		std::lock_guard<std::mutex> lock(s->aformat_lock);
+		format = s->aformat;
+	}
+	if (format.codec == AV_CODEC_ID_NONE) {
+		// Unsupported, the meta said so once already
+		return;
+	}
+	s->audio.samples_per_sec = format.sample_rate;
+	uint32_t pcm_bytes = ssp_pcm_bytes(format.codec);
+	if (pcm_bytes) {
+		ssp_on_pcm_data(audio, pcm_bytes, format.channels, s);
+		return;
+	}
+	if (ffmpeg_decode_valid(&s->adecoder) &&
+	    s->adecoder.codec->id != format.codec) {
+		ffmpeg_decode_free(&s->adecoder);
+	}
 	if (!ffmpeg_decode_valid(&s->adecoder)) {
-		if (ffmpeg_decode_init(&s->adecoder, s->aformat, false) < 0) {
+		if (ffmpeg_decode_init(&s->adecoder, format.codec, false,
+				       FFMPEG_DECODE_THROUGHPUT, 1) < 0) {
 			ssp_blog(LOG_WARNING,
 				 "Could not initialize audio decoder");
 			return;
@@ -267,7 +590,7 @@ static void ssp_on_audio_data(struct imf::SspAudioData *audio,
 				s->audio.timestamp +=
 					((uint64_t)s->audio.samples_per_sec *
 					 1000000000ULL /
-					 (uint64_t)s->sample_size);
+					 (uint64_t)format.sample_size);
 			} else {
 				s->audio.timestamp =
 					(uint64_t)audio->pts * 1000;
@@ -300,14 +623,57 @@ static void ssp_on_meta_data(struct imf::SspVideoMeta *v,
 		LOG_INFO,
 		"ssp i meta: pts_is_wall_clock: %u, tc_drop_frame:%u, timecode:%u,",
 		m->pts_is_wall_clock, m->tc_drop_frame, m->timecode);
-	s->vformat = v->encoder == VIDEO_ENCODER_H264 ? AV_CODEC_ID_H264
-						      : AV_CODEC_ID_H265;
-	s->frame.width = v->width;
-	s->frame.height = v->height;
-	s->sample_size = a->sample_size;
-	s->audio.samples_per_sec = a->sample_rate;
-	s->aformat = a->encoder == AUDIO_ENCODER_AAC ? AV_CODEC_ID_AAC
-						     : AV_CODEC_ID_NONE;
+	AVCodecID vformat = v->encoder == VIDEO_ENCODER_H264
+				    ? AV_CODEC_ID_H264
+				    : AV_CODEC_ID_H265;
+	// Mid-stream switch, the decode thread rebuilds its decoder at the
+	// new stream's first IDR. Frame sizes come from the decoded frames.
+	if (s->width && (vformat != s->vformat || v->width != s->width ||
+			 v->height != s->height)) {
+		ssp_blog(LOG_INFO,
+			 "%s stream changed, resuming at its first IDR",
+			 s->source_ip);
+		s->stream++;
+		if (s->queue) {
+			s->queue->restart();
+		}
+	}
+	s->vformat = vformat;
+	s->width = v->width;
+	s->height = v->height;
+	ssp_audio_format aformat = {AV_CODEC_ID_NONE, a->sample_rate,
+				    a->sample_size, a->channel};
+	if (a->encoder == AUDIO_ENCODER_AAC) {
+		aformat.codec = AV_CODEC_ID_AAC;
+	} else if (a->encoder == AUDIO_ENCODER_PCM) {
+		// sample_size is the sample width in bits for PCM
+		aformat.codec = ssp_pcm_format(a->sample_size);
+		if (aformat.codec == AV_CODEC_ID_NONE) {
+			ssp_blog(LOG_WARNING,
+				 "%s PCM audio with %u bit samples "
+				 "not supported",
+				 s->source_ip, a->sample_size);
+		} else if (ssp_pcm_speakers(a->channel) == SPEAKERS_UNKNOWN) {
+			ssp_blog(LOG_WARNING,
+				 "%s PCM audio with %u channels not supported",
+				 s->source_ip, a->channel);
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(s->aformat_lock);
+		s->aformat = aformat;
+	}
+	// Frame interval for the playout buffer, unit / timescale seconds
+	if (s->queue && v->timescale) {
+		s->queue->setFrameTime((uint64_t)v->unit * 1000000 /
+				       v->timescale);
+	}
+	// Decoder threads follow the pixel rate
+	if (v->unit) {
+		uint64_t rate = (uint64_t)v->width * v->height * v->timescale /
+				v->unit;
+		DecodeBudget::instance()->set(s, rate);
+	}
 }
 
 static void ssp_on_disconnected(ssp_connection *s)
@@ -370,6 +736,126 @@ static void ssp_on_exception(int code, const char *description,
 	//s->running = false;
 }
 
+static void ssp_on_recv_buffer_full(ssp_connection *s)
+{
+	s->recv_buffer_full++;
+}
+
+static void ssp_on_stats(const SSPClientStats &stats, ssp_connection *s)
+{
+	ssp_blog(LOG_INFO,
+		 "%s stats: video %llu frames %llu bytes %llu dropped, "
+		 "audio %llu frames %llu bytes, stream %u%s%s",
+		 s->source_ip, (unsigned long long)stats.video_frames,
+		 (unsigned long long)stats.video_bytes,
+		 (unsigned long long)stats.video_dropped,
+		 (unsigned long long)stats.audio_frames,
+		 (unsigned long long)stats.audio_bytes, stats.stream_style,
+		 stats.paused ? ", paused" : "",
+		 stats.drop_non_idr ? ", IDR only" : "");
+	// Where frames were shed: sender side, then our decode queue
+	ssp_blog(LOG_INFO,
+		 "%s backpressure: %llu shed by sender, %u recv buffer full, "
+		 "%u writer full; queue depth %u, %llu dropped late "
+		 "(%llu rest of GOP), %u recv buffer full seen",
+		 s->source_ip, (unsigned long long)stats.video_shed,
+		 stats.recv_buffer_full, stats.writer_full,
+		 s->queue ? s->queue->depth() : 0,
+		 (unsigned long long)(s->queue ? s->queue->dropped() : 0),
+		 (unsigned long long)(s->queue ? s->queue->skipped() : 0),
+		 s->recv_buffer_full.load());
+	if (s->queue) {
+		uint64_t avg_us, max_us;
+		s->queue->latency(&avg_us, &max_us);
+		ssp_blog(LOG_INFO,
+			 "%s decode queue: %zu bytes (all sources %zu), "
+			 "%llu budget evictions costing %llu frames; latency "
+			 "since last stats avg %llu us, max %llu us",
+			 s->source_ip, s->queue->bytes(),
+			 VFrameQueue::totalBytes(),
+			 (unsigned long long)s->queue->evictions(),
+			 (unsigned long long)s->queue->evicted(),
+			 (unsigned long long)avg_us,
+			 (unsigned long long)max_us);
+		auto pool = s->queue->poolStats();
+		ssp_blog(LOG_INFO,
+			 "%s frame pool: %llu hits, %llu misses, %llu trimmed, "
+			 "%zu bytes resident (%zu free), high water %zu",
+			 s->source_ip, (unsigned long long)pool.hits,
+			 (unsigned long long)pool.misses,
+			 (unsigned long long)pool.trimmed, pool.resident,
+			 pool.free, pool.high_water);
+		if (s->queue->jitterTarget()) {
+			ssp_blog(LOG_INFO,
+				 "%s playout buffer: %u frames, %llu underruns, "
+				 "%llu overruns",
+				 s->source_ip, s->queue->jitterTarget(),
+				 (unsigned long long)s->queue->underruns(),
+				 (unsigned long long)s->queue->overruns());
+		}
+	}
+	uint64_t decoded = s->vtiming.count.exchange(0);
+	uint64_t decode_ns = s->vtiming.sum.exchange(0);
+	ssp_blog(LOG_INFO,
+		 "%s video decoder (%s): %llu frames, in to out avg %llu us, "
+		 "max %llu us",
+		 s->source_ip, ssp_decode_profile_name(ssp_decode_profile(s)),
+		 (unsigned long long)decoded,
+		 (unsigned long long)(decoded ? decode_ns / decoded / 1000 : 0),
+		 (unsigned long long)(s->vtiming.max.exchange(0) / 1000));
+	auto budget = DecodeBudget::instance()->stats();
+	ssp_blog(LOG_INFO,
+		 "%s video decoder threads: %d, all sources %d of %d "
+		 "(%d sources)",
+		 s->source_ip, s->vdecoder.threads, budget.assigned,
+		 budget.budget, budget.sources);
+	auto workers = WorkerPool::instance()->stats();
+	ssp_blog(LOG_INFO,
+		 "decode pool: %u workers, %llu runs, %llu steals, "
+		 "%llu paced, %llu idle waits",
+		 workers.workers, (unsigned long long)workers.runs,
+		 (unsigned long long)workers.steals,
+		 (unsigned long long)workers.timed,
+		 (unsigned long long)workers.sleeps);
+	if (s->aqueue) {
+		AFrameQueue::Timing enq, dec;
+		s->aqueue->timing(&enq, &dec);
+		ssp_blog(LOG_INFO,
+			 "%s audio: %llu packets, receive thread avg %llu us "
+			 "max %llu us, decode avg %llu us max %llu us; "
+			 "queue depth %u, %llu dropped",
+			 s->source_ip, (unsigned long long)enq.count,
+			 (unsigned long long)enq.avg_us,
+			 (unsigned long long)enq.max_us,
+			 (unsigned long long)dec.avg_us,
+			 (unsigned long long)dec.max_us, s->aqueue->depth(),
+			 (unsigned long long)s->aqueue->dropped());
+	}
+}
+
+// Bandwidth mode and visibility, applied to the client without reconnecting.
+static void ssp_conn_apply_control(ssp_connection *conn, SSPClient *client)
+{
+	client->SetStreamStyle(conn->bandwidth == PROP_BW_LOWEST
+				       ? imf::STREAM_SEC
+				       : imf::STREAM_DEFAULT);
+	client->SetVideoPaused(conn->bandwidth == PROP_BW_AUDIO_ONLY ||
+			       (conn->pause_hidden && conn->hidden));
+}
+
+static void ssp_conn_update_control(ssp_connection *conn)
+{
+	pthread_mutex_lock(&conn->lck);
+	if (conn->client) {
+		ssp_conn_apply_control(conn, conn->client);
+	}
+	if (conn->queue) {
+		conn->queue->setDropSlack((uint64_t)conn->drop_slack * 1000);
+		conn->queue->setPacing(conn->latency == PROP_LATENCY_NORMAL);
+	}
+	pthread_mutex_unlock(&conn->lck);
+}
+
 static void ssp_start(ssp_source *s)
 {
 	auto conn = std::make_shared<ssp_connection>();
@@ -383,7 +869,19 @@ static void ssp_start(ssp_source *s)
 	conn->bitrate = s->bitrate;
 	conn->sync_mode = s->sync_mode;
 	conn->video_range = s->video_range;
+	conn->shm = s->shm;
+	conn->client_mode = s->client_mode;
+	conn->bandwidth = s->bandwidth;
+	conn->pause_hidden = s->pause_hidden;
+	conn->hidden = s->hidden;
+	conn->drop_slack = s->drop_slack;
+	conn->latency = s->latency;
+	conn->fast_decode = s->fast_decode;
 	conn->reconnect_attempt = 0;
+	conn->recv_buffer_full = 0;
+	conn->reconnect_time = 0;
+	conn->stream = 0;
+	conn->vdecoder_stream = 0;
 	pthread_mutex_init(&conn->lck, nullptr);
 
 	// Store weak_ptr in global map
@@ -403,6 +901,7 @@ static void ssp_conn_stop(ssp_connection *conn)
 	conn->running = false;
 	auto client = conn->client;
 	auto queue = conn->queue;
+	auto aqueue = conn->aqueue;
 
 	if (client) {
 		client->Stop();
@@ -412,6 +911,10 @@ static void ssp_conn_stop(ssp_connection *conn)
 		queue->stop();
 		delete queue;
 	}
+	if (aqueue) {
+		aqueue->stop();
+		delete aqueue;
+	}
 
 	ssp_blog(LOG_INFO, "SSP client stopped.");
 
@@ -421,6 +924,7 @@ static void ssp_conn_stop(ssp_connection *conn)
 	if (ffmpeg_decode_valid(&conn->vdecoder)) {
 		ffmpeg_decode_free(&conn->vdecoder);
 	}
+	DecodeBudget::instance()->remove(conn);
 
 	ssp_blog(LOG_INFO, "SSP conn stopped.");
 	pthread_mutex_unlock(&conn->lck);
@@ -449,6 +953,33 @@ static void ssp_stop(ssp_source *s)
 	// No need to bfree conn as shared_ptr will handle deletion
 }
 
+static SSPClient *ssp_conn_create_client(ssp_connection *s)
+{
+	std::string ip = s->source_ip;
+	SSPClient *client = nullptr;
+	if (s->client_mode == PROP_CLIENT_INPROC) {
+		if (SSPClientInproc::available()) {
+			client = new SSPClientInproc(ip, s->bitrate / 8);
+		} else {
+			ssp_blog(
+				LOG_WARNING,
+				"In-process mode unavailable, using ssp-connector");
+		}
+	} else if (s->client_mode == PROP_CLIENT_SHARED) {
+		client = new SSPClientMux(ip, s->bitrate / 8);
+	}
+	if (!client) {
+		auto iso = new SSPClientIso(ip, s->bitrate / 8);
+		iso->setSharedMemory(s->shm);
+		client = iso;
+	}
+	client->setOnStatsCallback(std::bind(ssp_on_stats, _1, s));
+	client->setOnRecvBufferFullCallback(
+		std::bind(ssp_on_recv_buffer_full, s));
+	ssp_conn_apply_control(s, client);
+	return client;
+}
+
 static void ssp_conn_start(ssp_connection *s)
 {
 	ssp_blog(LOG_INFO, "Starting ssp client...");
@@ -462,10 +993,11 @@ static void ssp_conn_start(ssp_connection *s)
 		return;
 	}
 	pthread_mutex_lock(&s->lck);
-	s->client = new SSPClientIso(ip, s->bitrate / 8);
+	s->client = ssp_conn_create_client(s);
 	s->client->setOnH264DataCallback(
-		std::bind(ssp_video_data_enqueue, _1, s));
-	s->client->setOnAudioDataCallback(std::bind(ssp_on_audio_data, _1, s));
+		std::bind(ssp_video_data_enqueue, _1, _2, s));
+	s->client->setOnAudioDataCallback(
+		std::bind(ssp_audio_data_enqueue, _1, s));
 	s->client->setOnMetaCallback(
 		std::bind(ssp_on_meta_data, _1, _2, _3, s));
 	s->client->setOnConnectionConnectedCallback([s]() {
@@ -481,10 +1013,19 @@ static void ssp_conn_start(ssp_connection *s)
 
 	assert(s->queue == nullptr);
 	s->queue = new VFrameQueue;
-	s->queue->setFrameCallback(std::bind(ssp_on_video_data, _1, s));
+	s->queue->setFrameCallback(
+		std::bind(ssp_on_video_data, _1, _2, _3, _4, s));
+	s->queue->setDropSlack((uint64_t)s->drop_slack * 1000);
+	s->queue->setPacing(s->latency == PROP_LATENCY_NORMAL);
+	s->queue->setName(s->source_ip);
+
+	assert(s->aqueue == nullptr);
+	s->aqueue = new AFrameQueue;
+	s->aqueue->setFrameCallback(std::bind(ssp_on_audio_data, _1, s));
 
 	s->queue->start();
-	emit s->client->Start();
+	s->aqueue->start();
+	s->client->Start();
 	s->running = true;
 	pthread_mutex_unlock(&s->lck);
 	ssp_blog(LOG_INFO, "SSP client started.");
@@ -531,6 +1072,7 @@ void *thread_ssp_reconnect(void *data)
 	}
 	auto client = conn->client;
 	auto queue = conn->queue;
+	auto aqueue = conn->aqueue;
 
 	if (client) {
 		client->Stop();
@@ -542,15 +1084,27 @@ void *thread_ssp_reconnect(void *data)
 		delete queue;
 		conn->queue = nullptr;
 	}
+	if (aqueue) {
+		aqueue->stop();
+		delete aqueue;
+		conn->aqueue = nullptr;
+	}
 
 	ssp_blog(LOG_INFO, "SSP client stopped.");
 
+	// Decoders stay open for the same stream, ssp_on_video_data replaces
+	// the video one if the meta says otherwise. Flushed, they hold no
+	// frames but still know the parameter sets, so the first IDR decodes.
 	if (ffmpeg_decode_valid(&conn->adecoder)) {
-		ffmpeg_decode_free(&conn->adecoder);
+		ffmpeg_decode_flush(&conn->adecoder);
 	}
 	if (ffmpeg_decode_valid(&conn->vdecoder)) {
-		ffmpeg_decode_free(&conn->vdecoder);
+		ffmpeg_decode_flush(&conn->vdecoder);
 	}
+	conn->reconnect_warm = ffmpeg_decode_valid(&conn->vdecoder);
+	conn->reconnect_time = os_gettime_ns();
+	// References from before the drop are gone
+	conn->i_frame_shown = false;
 
 	ssp_blog(LOG_INFO, "SSP conn stopped.");
 
@@ -565,11 +1119,11 @@ void *thread_ssp_reconnect(void *data)
 		pthread_mutex_unlock(&conn->lck);
 		return nullptr;
 	}
-	conn->client = new SSPClientIso(ip, conn->bitrate / 8);
+	conn->client = ssp_conn_create_client(conn);
 	conn->client->setOnH264DataCallback(
-		std::bind(ssp_video_data_enqueue, _1, conn));
+		std::bind(ssp_video_data_enqueue, _1, _2, conn));
 	conn->client->setOnAudioDataCallback(
-		std::bind(ssp_on_audio_data, _1, conn));
+		std::bind(ssp_audio_data_enqueue, _1, conn));
 	conn->client->setOnMetaCallback(
 		std::bind(ssp_on_meta_data, _1, _2, _3, conn));
 	conn->client->setOnConnectionConnectedCallback(
@@ -581,10 +1135,23 @@ void *thread_ssp_reconnect(void *data)
 
 	assert(conn->queue == nullptr);
 	conn->queue = new VFrameQueue;
-	conn->queue->setFrameCallback(std::bind(ssp_on_video_data, _1, conn));
+	conn->queue->setFrameCallback(
+		std::bind(ssp_on_video_data, _1, _2, _3, _4, conn));
+	conn->queue->setDropSlack((uint64_t)conn->drop_slack * 1000);
+	conn->queue->setPacing(conn->latency == PROP_LATENCY_NORMAL);
+	conn->queue->setName(conn->source_ip);
+	// The kept decoder lost its references in the flush, hand it nothing
+	// before the first IDR whether or not wait_i_frame is set.
+	conn->queue->restart();
+
+	assert(conn->aqueue == nullptr);
+	conn->aqueue = new AFrameQueue;
+	conn->aqueue->setFrameCallback(
+		std::bind(ssp_on_audio_data, _1, conn));
 
 	conn->queue->start();
-	emit conn->client->Start();
+	conn->aqueue->start();
+	conn->client->Start();
 	pthread_mutex_unlock(&conn->lck);
 	ssp_blog(LOG_INFO, "SSP client started.");
 
@@ -808,6 +1375,22 @@ static bool check_ip_callback(obs_properties_t *props, obs_property_t *property,
 	return false;
 }
 
+static bool stats_callback(obs_properties_t *props, obs_property_t *property,
+			   void *data)
+{
+	auto s = (struct ssp_source *)data;
+	auto conn = s->conn;
+	if (!conn) {
+		return false;
+	}
+	pthread_mutex_lock(&conn->lck);
+	if (conn->client) {
+		conn->client->RequestStats();
+	}
+	pthread_mutex_unlock(&conn->lck);
+	return false;
+}
+
 obs_properties_t *ssp_source_getproperties(void *data)
 {
 	char nametext[256];
@@ -904,6 +1487,50 @@ obs_properties_t *ssp_source_getproperties(void *data)
 		props, PROP_HW_ACCEL,
 		obs_module_text("SSPPlugin.SourceProps.HWAccel"));
 
+	obs_property_t *client_modes = obs_properties_add_list(
+		props, PROP_CLIENT_MODE,
+		obs_module_text("SSPPlugin.SourceProps.ClientMode"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(
+		client_modes, obs_module_text("SSPPlugin.ClientMode.Isolated"),
+		PROP_CLIENT_ISOLATED);
+	obs_property_list_add_int(
+		client_modes, obs_module_text("SSPPlugin.ClientMode.InProcess"),
+		PROP_CLIENT_INPROC);
+	obs_property_list_add_int(
+		client_modes, obs_module_text("SSPPlugin.ClientMode.Shared"),
+		PROP_CLIENT_SHARED);
+
+	obs_properties_add_bool(props, PROP_SHM,
+				obs_module_text("SSPPlugin.SourceProps.Shm"));
+
+	obs_property_t *bandwidths = obs_properties_add_list(
+		props, PROP_BANDWIDTH,
+		obs_module_text("SSPPlugin.SourceProps.Bandwidth"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(
+		bandwidths, obs_module_text("SSPPlugin.Bandwidth.Highest"),
+		PROP_BW_HIGHEST);
+	obs_property_list_add_int(
+		bandwidths, obs_module_text("SSPPlugin.Bandwidth.Lowest"),
+		PROP_BW_LOWEST);
+	obs_property_list_add_int(
+		bandwidths, obs_module_text("SSPPlugin.Bandwidth.AudioOnly"),
+		PROP_BW_AUDIO_ONLY);
+
+	obs_properties_add_bool(
+		props, PROP_PAUSE_HIDDEN,
+		obs_module_text("SSPPlugin.SourceProps.PauseHidden"));
+
+	obs_property_t *slack = obs_properties_add_int_slider(
+		props, PROP_DROP_SLACK,
+		obs_module_text("SSPPlugin.SourceProps.DropSlack"), 0, 200, 1);
+	obs_property_int_set_suffix(slack, " ms");
+
+	obs_properties_add_button2(props, PROP_STATS,
+				   obs_module_text("SSPPlugin.SourceProps.Stats"),
+				   stats_callback, data);
+
 	obs_property_t *latency_modes = obs_properties_add_list(
 		props, PROP_LATENCY,
 		obs_module_text("SSPPlugin.SourceProps.Latency"),
@@ -918,6 +1545,10 @@ obs_properties_t *ssp_source_getproperties(void *data)
 		obs_module_text("SSPPlugin.SourceProps.Latency.Low"),
 		PROP_LATENCY_LOW);
 
+	obs_properties_add_bool(
+		props, PROP_FAST_DECODE,
+		obs_module_text("SSPPlugin.SourceProps.FastDecode"));
+
 	obs_property_t *encoders = obs_properties_add_list(
 		props, PROP_ENCODER,
 		obs_module_text("SSPPlugin.SourceProps.Encoder"),
@@ -998,6 +1629,14 @@ void ssp_source_getdefaults(obs_data_t *settings)
 	obs_data_set_default_string(settings, PROP_CUSTOM_SOURCE_IP, "");
 	obs_data_set_default_int(settings, PROP_BITRATE, 20);
 	obs_data_set_default_bool(settings, PROP_HW_ACCEL, false);
+	obs_data_set_default_bool(settings, PROP_SHM, false);
+	obs_data_set_default_int(settings, PROP_CLIENT_MODE,
+				 PROP_CLIENT_ISOLATED);
+	obs_data_set_default_int(settings, PROP_BANDWIDTH, PROP_BW_HIGHEST);
+	obs_data_set_default_bool(settings, PROP_PAUSE_HIDDEN, false);
+	obs_data_set_default_bool(settings, PROP_FAST_DECODE, false);
+	obs_data_set_default_int(settings, PROP_DROP_SLACK,
+				 VFRAME_DROP_SLACK_US / 1000);
 	obs_data_set_default_bool(settings, PROP_EXP_WAIT_I, true);
 	obs_data_set_default_bool(settings, PROP_LED_TALLY, false);
 	obs_data_set_default_bool(settings, PROP_LOW_NOISE, false);
@@ -1029,6 +1668,21 @@ static bool settings_changed(obs_data_t *new_settings, ssp_source *s)
 		return true;
 	}
 
+	bool new_shm = obs_data_get_bool(new_settings, PROP_SHM);
+	if (s->shm != new_shm) {
+		ssp_blog(LOG_INFO, "Shared memory setting changed from %d to %d",
+			 s->shm, new_shm);
+		return true;
+	}
+
+	int new_client_mode =
+		(int)obs_data_get_int(new_settings, PROP_CLIENT_MODE);
+	if (s->client_mode != new_client_mode) {
+		ssp_blog(LOG_INFO, "Client mode changed from %d to %d",
+			 s->client_mode, new_client_mode);
+		return true;
+	}
+
 	int new_sync_mode = (int)obs_data_get_int(new_settings, PROP_SYNC);
 	if (s->sync_mode != new_sync_mode) {
 		ssp_blog(LOG_INFO, "Sync mode changed from %d to %d",
@@ -1103,6 +1757,23 @@ void ssp_source_update(void *data, obs_data_t *settings)
 {
 	auto s = (struct ssp_source *)data;
 
+	// Applied to the running connection, no restart needed
+	s->bandwidth = (int)obs_data_get_int(settings, PROP_BANDWIDTH);
+	s->pause_hidden = obs_data_get_bool(settings, PROP_PAUSE_HIDDEN);
+	s->drop_slack = (int)obs_data_get_int(settings, PROP_DROP_SLACK);
+	s->latency = (int)obs_data_get_int(settings, PROP_LATENCY);
+	s->fast_decode = obs_data_get_bool(settings, PROP_FAST_DECODE);
+	obs_source_set_async_unbuffered(s->source,
+					s->latency == PROP_LATENCY_LOW);
+	if (s->conn) {
+		s->conn->bandwidth = s->bandwidth;
+		s->conn->pause_hidden = s->pause_hidden;
+		s->conn->drop_slack = s->drop_slack;
+		s->conn->latency = s->latency;
+		s->conn->fast_decode = s->fast_decode;
+		ssp_conn_update_control(s->conn.get());
+	}
+
 	// Compare new settings with our stored data
 	bool needs_restart = settings_changed(settings, s);
 
@@ -1117,6 +1788,8 @@ void ssp_source_update(void *data, obs_data_t *settings)
 	ssp_stop(s);
 
 	s->hwaccel = obs_data_get_bool(settings, PROP_HW_ACCEL);
+	s->shm = obs_data_get_bool(settings, PROP_SHM);
+	s->client_mode = (int)obs_data_get_int(settings, PROP_CLIENT_MODE);
 	s->sync_mode = (int)obs_data_get_int(settings, PROP_SYNC);
 	const char *source_ip = obs_data_get_string(settings, PROP_SOURCE_IP);
 	if (strcmp(source_ip, PROP_CUSTOM_VALUE) == 0) {
@@ -1162,10 +1835,6 @@ void ssp_source_update(void *data, obs_data_t *settings)
 	// Set the IP of our camera from the configuration (used to build the url)
 	//s->cameraStatus->setIp(s->source_ip);
 
-	const bool is_unbuffered =
-		(obs_data_get_int(settings, PROP_LATENCY) == PROP_LATENCY_LOW);
-	obs_source_set_async_unbuffered(s->source, is_unbuffered);
-
 	s->wait_i_frame = obs_data_get_bool(settings, PROP_EXP_WAIT_I);
 
 	s->tally = obs_data_get_bool(settings, PROP_LED_TALLY);
@@ -1246,6 +1915,11 @@ void ssp_source_shown(void *data)
 	if (s->tally && s->cameraStatus) {
 		s->cameraStatus->setLed(true);
 	}
+	s->hidden = false;
+	if (s->conn) {
+		s->conn->hidden = false;
+		ssp_conn_update_control(s->conn.get());
+	}
 	ssp_blog(LOG_INFO, "ssp source shown.");
 }
 
@@ -1255,6 +1929,11 @@ void ssp_source_hidden(void *data)
 	if (s->tally && s->cameraStatus) {
 		s->cameraStatus->setLed(false);
 	}
+	s->hidden = true;
+	if (s->conn) {
+		s->conn->hidden = true;
+		ssp_conn_update_control(s->conn.get());
+	}
 	ssp_blog(LOG_INFO, "ssp source hidden.");
 }
 
@@ -1281,6 +1960,14 @@ void *ssp_source_create(obs_data_t *settings, obs_source_t *source)
 	s->sync_mode = PROP_SYNC_SSP_TIMESTAMP;
 	s->wait_i_frame = true;
 	s->hwaccel = false;
+	s->shm = false;
+	s->client_mode = PROP_CLIENT_ISOLATED;
+	s->bandwidth = PROP_BW_HIGHEST;
+	s->pause_hidden = false;
+	s->drop_slack = VFRAME_DROP_SLACK_US / 1000;
+	s->latency = PROP_LATENCY_LOW;
+	// OBS calls show once the source is on screen
+	s->hidden = !obs_source_showing(source);
 
 	// Get source IP from settings
 	const char *sourceIp = obs_data_get_string(settings, PROP_SOURCE_IP);
@@ -29,6 +29,7 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #include <util/platform.h>
 #include <util/dstr.h>
 #include <QDir>
+#include <QFileInfo>
 #include <QAction>
 #include <QMainWindow>
 #include <QMessageBox>
@@ -36,6 +37,9 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #include "obs-ssp.h"
 #include "ssp-controller.h"
 #include "ssp-toolbar.h"
+#include "WorkerPool.h"
+#include "DecodeBudget.h"
+#include "ssp-pipe-reactor.h"
 #if defined(__APPLE__)
 #include <dlfcn.h>
 #endif
@@ -59,8 +63,46 @@ struct obs_source_info ssp_source_info;
 create_ssp_class_ptr create_ssp_class;
 create_loop_class_ptr create_loop_class;
 
+static void *libssp_module = nullptr;
 static SspDock *ssp_dock = nullptr;
 
+// libssp is only needed in-process for the in-process client mode, the
+// connector links it on its own. A missing library is not fatal.
+static void load_libssp()
+{
+#if defined(__APPLE__)
+	Dl_info info;
+	dladdr((const void *)load_libssp, &info);
+	QFileInfo plugin_path(info.dli_fname);
+	std::string path =
+		plugin_path.dir()
+			.filePath(QStringLiteral(LIBSSP_LIBRARY_NAME))
+			.toStdString();
+#else
+	std::string path = LIBSSP_LIBRARY_NAME;
+#endif
+	libssp_module = os_dlopen(path.c_str());
+	if (!libssp_module) {
+		ssp_blog(LOG_INFO,
+			 "libssp not found at %s, in-process mode disabled",
+			 path.c_str());
+		return;
+	}
+	create_ssp_class = (create_ssp_class_ptr)os_dlsym(libssp_module,
+							  "create_ssp_class");
+	create_loop_class = (create_loop_class_ptr)os_dlsym(
+		libssp_module, "create_loop_class");
+	if (!create_ssp_class || !create_loop_class) {
+		ssp_blog(LOG_WARNING,
+			 "libssp at %s lacks the class factories, in-process mode disabled",
+			 path.c_str());
+		create_ssp_class = nullptr;
+		create_loop_class = nullptr;
+		os_dlclose(libssp_module);
+		libssp_module = nullptr;
+	}
+}
+
 static void show_ssp_dock(void *data, obs_data_t *settings)
 {
 	if (!ssp_dock) {
@@ -136,6 +178,7 @@ bool obs_module_load(void)
 	CameraStatusManager::instance();
 	ssp_blog(LOG_INFO, "CameraStatusManager initialized");
 
+	load_libssp();
 	create_mdns_loop();
 	ssp_source_info = create_ssp_source_info();
 	obs_register_source(&ssp_source_info);
@@ -204,6 +247,19 @@ void obs_module_unload()
 		LOG_INFO,
 		"[obs-ssp] obs_module_unload: CameraStatusManager cleaned up.");
 
+	// Every source is destroyed by now, nothing is left on the workers
+	// and every connector pipe is closed.
+	WorkerPool::destroyInstance();
+	DecodeBudget::destroyInstance();
+	SspPipeReactor::destroyInstance();
+
+	if (libssp_module) {
+		create_ssp_class = nullptr;
+		create_loop_class = nullptr;
+		os_dlclose(libssp_module);
+		libssp_module = nullptr;
+	}
+
 	ssp_blog(
 		LOG_INFO,
 		"[obs-ssp] obs_module_unload: Goodbye!"); // Changed from ssp_blog for consistency example
@@ -0,0 +1,266 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <obs.h>
+#include <util/platform.h>
+#include <chrono>
+
+#include "obs-ssp.h"
+#include "ssp-client-inproc.h"
+
+#define SSP_INPROC_PORT 9999
+#define SSP_INPROC_RECV_BUFFER 0x400000
+// How long Stop waits for the loop thread to finish setting up.
+#define SSP_INPROC_SETUP_TIMEOUT_MS 5000
+
+bool SSPClientInproc::available()
+{
+	return create_ssp_class != nullptr && create_loop_class != nullptr;
+}
+
+SSPClientInproc::SSPClientInproc(const std::string &ip, uint32_t bufferSize)
+{
+	this->ip = ip;
+	this->bufferSize = bufferSize;
+	this->threadLoop = nullptr;
+	this->client = nullptr;
+	this->waitIdr = false;
+	this->shedding = false;
+	this->videoFrames = 0;
+	this->videoBytes = 0;
+	this->videoDropped = 0;
+	this->videoShed = 0;
+	this->recvBufferFull = 0;
+	this->audioFrames = 0;
+	this->audioBytes = 0;
+}
+
+SSPClientInproc::~SSPClientInproc()
+{
+	Stop();
+
+	bufferFullCallback = nullptr;
+	audioDataCallback = nullptr;
+	metaCallback = nullptr;
+	disconnectedCallback = nullptr;
+	connectedCallback = nullptr;
+	h264DataCallback = nullptr;
+	exceptionCallback = nullptr;
+}
+
+/*
+ * Runs on the loop thread. Nothing of self is touched before state says
+ * Stop is still waiting: once it gave up, self may have been deleted.
+ */
+void SSPClientInproc::setup(SSPClientInproc *self,
+			    std::shared_ptr<Setup> state, std::string ip,
+			    uint32_t style, imf::Loop *loop)
+{
+	auto c = create_ssp_class(ip, loop, SSP_INPROC_RECV_BUFFER,
+				  SSP_INPROC_PORT, style);
+	bool ok = c && c->init() >= 0;
+
+	std::lock_guard<std::mutex> lock(state->lock);
+	if (!ok || state->state == SETUP_ABANDONED) {
+		if (c) {
+			c->destroy();
+		}
+		if (state->state != SETUP_ABANDONED) {
+			ssp_blog(LOG_ERROR, "ssp client %s could not be set up",
+				 ip.c_str());
+			state->state = SETUP_FAILED;
+		}
+		state->cond.notify_all();
+		return;
+	}
+
+	c->setOnH264DataCallback([self](imf::SspH264Data *video) {
+		if (self->forwardVideo(video)) {
+			self->h264DataCallback(video, nullptr);
+		}
+	});
+	c->setOnAudioDataCallback([self](imf::SspAudioData *audio) {
+		self->audioFrames++;
+		self->audioBytes += audio->len;
+		self->audioDataCallback(audio);
+	});
+	c->setOnMetaCallback([self](imf::SspVideoMeta *v, imf::SspAudioMeta *a,
+				    imf::SspMeta *m) {
+		self->metaCallback(v, a, m);
+	});
+	c->setOnRecvBufferFullCallback([self]() {
+		self->recvBufferFull++;
+		self->shedding = true;
+		if (self->bufferFullCallback) {
+			self->bufferFullCallback();
+		}
+	});
+	c->setOnConnectionConnectedCallback(
+		[self]() { self->connectedCallback(); });
+	c->setOnDisconnectedCallback(
+		[self]() { self->disconnectedCallback(); });
+	c->setOnExceptionCallback([self](int code, const char *description) {
+		self->exceptionCallback(code, description);
+	});
+	c->start();
+
+	self->client = c;
+	state->state = SETUP_READY;
+	state->cond.notify_all();
+}
+
+void SSPClientInproc::Start()
+{
+	std::lock_guard<std::mutex> lock(statusLock);
+	if (threadLoop) {
+		return;
+	}
+	if (!available()) {
+		ssp_blog(LOG_WARNING, "libssp not loaded, cannot start %s",
+			 ip.c_str());
+		return;
+	}
+	blog(LOG_INFO, "Start in-process ssp client for %s", ip.c_str());
+	setupState = std::make_shared<Setup>();
+	threadLoop = new imf::ThreadLoop(
+		std::bind(&SSPClientInproc::setup, this, setupState, ip,
+			  (uint32_t)streamStyle, std::placeholders::_1),
+		[]() { return create_loop_class(); });
+	threadLoop->start();
+}
+
+void SSPClientInproc::Stop()
+{
+	std::lock_guard<std::mutex> lock(statusLock);
+	blog(LOG_INFO, "ssp client %s stopping...", ip.c_str());
+	if (!threadLoop) {
+		blog(LOG_INFO, "ssp client %s already stopped...", ip.c_str());
+		return;
+	}
+	// ThreadLoop::stop needs the loop created by the thread, it is there
+	// once setup has run, whether that worked or not.
+	std::shared_ptr<Setup> state = std::move(setupState);
+	auto timeout = std::chrono::milliseconds(SSP_INPROC_SETUP_TIMEOUT_MS);
+	bool settled;
+	{
+		std::unique_lock<std::mutex> lock(state->lock);
+		settled = state->cond.wait_for(lock, timeout, [&state] {
+			return state->state != SETUP_PENDING;
+		});
+		if (!settled) {
+			state->state = SETUP_ABANDONED;
+		}
+	}
+	if (!settled) {
+		// Stuck in libssp. Leave the thread behind rather than hang
+		// OBS, setup drops the client when it gets out.
+		ssp_blog(LOG_ERROR,
+			 "ssp client %s did not set up in %d ms, "
+			 "abandoning its thread",
+			 ip.c_str(), SSP_INPROC_SETUP_TIMEOUT_MS);
+		threadLoop = nullptr;
+		return;
+	}
+	threadLoop->stop();
+	if (client) {
+		client->destroy();
+		client = nullptr;
+	}
+	delete threadLoop;
+	threadLoop = nullptr;
+}
+
+void SSPClientInproc::Restart()
+{
+	Stop();
+	Start();
+}
+
+// Same filtering the connector does, type 5 is an IDR frame.
+bool SSPClientInproc::forwardVideo(imf::SspH264Data *video)
+{
+	bool idr = video->type == 5;
+	if (videoPaused || (waitIdr && !idr) || (dropNonIdr && !idr)) {
+		videoDropped++;
+		return false;
+	}
+	waitIdr = false;
+
+	if (queueCongested) {
+		shedding = true;
+	}
+	if (shedding) {
+		if (!idr) {
+			videoShed++;
+			return false;
+		}
+		if (!queueCongested) {
+			shedding = false;
+		}
+	}
+	videoFrames++;
+	videoBytes += video->len;
+	return true;
+}
+
+void SSPClientInproc::SetVideoPaused(bool paused)
+{
+	if (videoPaused.exchange(paused) == paused) {
+		return;
+	}
+	if (!paused) {
+		waitIdr = true;
+	}
+}
+
+void SSPClientInproc::SetStreamStyle(uint32_t style)
+{
+	if (streamStyle.exchange(style) == style) {
+		return;
+	}
+	bool started;
+	{
+		std::lock_guard<std::mutex> lock(statusLock);
+		started = threadLoop != nullptr;
+	}
+	// libssp picks the stream when connecting.
+	if (started) {
+		waitIdr = true;
+		Restart();
+	}
+}
+
+void SSPClientInproc::RequestStats()
+{
+	if (!statsCallback) {
+		return;
+	}
+	SSPClientStats stats;
+	stats.video_frames = videoFrames;
+	stats.video_bytes = videoBytes;
+	stats.video_dropped = videoDropped;
+	stats.video_shed = videoShed;
+	stats.audio_frames = audioFrames;
+	stats.audio_bytes = audioBytes;
+	stats.stream_style = streamStyle;
+	stats.paused = videoPaused;
+	stats.drop_non_idr = dropNonIdr;
+	stats.recv_buffer_full = recvBufferFull;
+	stats.writer_full = 0;
+	statsCallback(stats);
+}
@@ -0,0 +1,86 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_SSP_CLIENT_INPROC_H
+#define OBS_SSP_SSP_CLIENT_INPROC_H
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <imf/ISspClient.h>
+#include <imf/threadloop.h>
+#include "ssp-client.h"
+
+/*
+ * Runs libssp inside the OBS process on its own ThreadLoop. Callbacks get
+ * the libssp buffers directly, without the connector process and pipe in
+ * between. A crash in libssp takes OBS down with it, so this is opt-in.
+ */
+class SSPClientInproc : public SSPClient {
+public:
+	SSPClientInproc(const std::string &ip, uint32_t bufferSize);
+	~SSPClientInproc() override;
+	void Start() override;
+	void Stop() override;
+	void Restart() override;
+	std::string getIp() override { return ip; };
+	void SetVideoPaused(bool paused) override;
+	void SetStreamStyle(uint32_t style) override;
+	void RequestStats() override;
+
+	// libssp was loaded by obs_module_load
+	static bool available();
+
+private:
+	enum SetupState {
+		SETUP_PENDING,
+		SETUP_READY,
+		SETUP_FAILED,
+		SETUP_ABANDONED, // Stop gave up waiting, this may be gone
+	};
+	// Shared with the loop thread, it may outlive an abandoned client.
+	struct Setup {
+		std::mutex lock;
+		std::condition_variable cond;
+		SetupState state = SETUP_PENDING;
+	};
+
+	static void setup(SSPClientInproc *self, std::shared_ptr<Setup> state,
+			  std::string ip, uint32_t style, imf::Loop *loop);
+	bool forwardVideo(imf::SspH264Data *video);
+
+	std::mutex statusLock;
+	std::shared_ptr<Setup> setupState;
+	std::string ip;
+	uint32_t bufferSize;
+
+	imf::ThreadLoop *threadLoop;
+	imf::ISspClient_class *client;
+
+	std::atomic<bool> waitIdr;
+	std::atomic<bool> shedding;
+	std::atomic<uint64_t> videoFrames;
+	std::atomic<uint64_t> videoBytes;
+	std::atomic<uint64_t> videoDropped;
+	std::atomic<uint64_t> videoShed;
+	std::atomic<uint32_t> recvBufferFull;
+	std::atomic<uint64_t> audioFrames;
+	std::atomic<uint64_t> audioBytes;
+};
+
+#endif //OBS_SSP_SSP_CLIENT_INPROC_H
@@ -19,16 +19,18 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #include <obs.h>
 #include <util/dstr.h>
 #include <util/platform.h>
-#include <memory> // For std::unique_ptr
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <unistd.h>
 #endif
 
 #if defined(__APPLE__)
 #include <dlfcn.h>
 #endif
 
+#include <vector>
 #include <QUuid>
 #include <QFileInfo>
 #include <QDir>
@@ -43,74 +45,22 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #include <QFileInfo>
 #include <QDebug>
 
-static size_t os_process_pipe_read_retry(os_process_pipe *pipe, uint8_t *dst,
-					 size_t size)
+static bool msg_send(os_process_pipe *pipe, uint32_t type, uint32_t stream,
+		     const void *body, uint32_t length)
 {
-	size_t pos = 0, cur = 0;
-	while (pos < size) {
-		cur = os_process_pipe_read(pipe, dst + pos, size - pos);
-		if (!cur) {
-			break;
-		}
-		pos += cur;
+	Message msg;
+	msg.type = type;
+	msg.length = length;
+	msg.stream = stream;
+	if (os_process_pipe_write(pipe, (const uint8_t *)&msg, sizeof(msg)) !=
+	    sizeof(msg)) {
+		return false;
 	}
-	return pos;
-}
-
-static Message *msg_recv(os_process_pipe *pipe)
-{
-	size_t sz = 0;
-	Message *msg = (Message *)bmalloc(sizeof(Message));
-	if (!msg) {
-		return nullptr;
+	if (length &&
+	    os_process_pipe_write(pipe, (const uint8_t *)body, length) != length) {
+		return false;
 	}
-	sz = os_process_pipe_read_retry(pipe, (uint8_t *)msg, sizeof(Message));
-	if (sz != sizeof(Message)) {
-		ssp_blog(LOG_WARNING, "pipe protocol header error, recv: %d!",
-			 sz);
-		bfree(msg);
-		return nullptr;
-	}
-	if (msg->length == 0) {
-		return msg;
-	}
-	Message *msg_all = nullptr;
-	msg_all = (Message *)bmalloc(sizeof(Message) + msg->length);
-	memcpy(msg_all, msg, sizeof(Message));
-	bfree(msg);
-	//ssp_blog(LOG_INFO, "receive msg type: %d, size: %d", msg_all->type, msg_all->length);
-	sz = os_process_pipe_read_retry(pipe, msg_all->value, msg_all->length);
-	if (sz != msg_all->length) {
-		ssp_blog(LOG_WARNING, "pipe protocol body error, recv: %d!",
-			 sz);
-		bfree(msg_all);
-		return nullptr;
-	}
-	return msg_all;
-}
-
-static void msg_free(Message *msg)
-{
-	if (msg) {
-		bfree(msg);
-	}
-}
-
-static void *dump_stderr(os_process_pipe *pipe)
-{
-	size_t sz;
-	char buf[1024];
-	while (true) {
-		sz = os_process_pipe_read_err(pipe, (uint8_t *)buf,
-					      sizeof(buf) - 1);
-		if (sz == 0) {
-			break;
-		}
-		buf[sz] = '\0';
-		ssp_blog(LOG_INFO, "%s", buf);
-	}
-	ssp_blog(LOG_INFO, "read thread exited");
-	return nullptr;
+	return true;
 }
 
 SSPClientIso::SSPClientIso(const std::string &ip, uint32_t bufferSize)
@@ -119,17 +69,22 @@ SSPClientIso::SSPClientIso(const std::string &ip, uint32_t bufferSize)
 	this->bufferSize = bufferSize;
 	this->running = false;
 	this->pipe = nullptr;
+	this->useShm = false;
+	this->shm = nullptr;
+	this->metaSeen = false;
+	this->connectorOk = false;
+	this->protocolError = false;
 
 #if defined(__APPLE__)
 	Dl_info info;
-	dladdr((const void *)msg_free, &info);
+	dladdr((const void *)msg_send, &info);
 	QFileInfo plugin_path(info.dli_fname);
 	ssp_connector_path =
 		plugin_path.dir().filePath(QStringLiteral(SSP_CONNECTOR));
 #else
 	ssp_connector_path = QStringLiteral(SSP_CONNECTOR);
 #endif
-	connect(this, SIGNAL(Start()), this, SLOT(doStart()));
+	connect(this, SIGNAL(startRequested()), this, SLOT(doStart()));
 }
 
 SSPClientIso::~SSPClientIso()
@@ -138,7 +93,7 @@ SSPClientIso::~SSPClientIso()
 	Stop();
 
 	// Disconnect all signals to prevent callbacks after destruction
-	disconnect(this, SIGNAL(Start()), this, SLOT(doStart()));
+	disconnect(this, SIGNAL(startRequested()), this, SLOT(doStart()));
 
 	// Clear all callbacks to prevent dangling references
 	bufferFullCallback = nullptr;
@@ -163,93 +118,167 @@ void SSPClientIso::doStart()
 	dstr_cat(&cmd, this->ip.c_str());
 	dstr_cat(&cmd, " --port ");
 	dstr_cat(&cmd, "9999");
+	dstr_cat(&cmd, " --control --aux --style ");
+	uint32_t style = this->streamStyle;
+	dstr_catf(&cmd, "%u", style);
+
+	if (this->useShm) {
+		static std::atomic<uint32_t> shm_serial{0};
+		char name[SSP_SHM_NAME_MAX];
+#ifdef _WIN32
+		snprintf(name, sizeof(name), "Local\\obs-ssp-%lu-%u",
+			 GetCurrentProcessId(), shm_serial++);
+#else
+		snprintf(name, sizeof(name), "/obs-ssp-%d-%u", (int)getpid(),
+			 shm_serial++);
+#endif
+		this->shm = SspShmRing::create(name, SSP_SHM_DEFAULT_SIZE);
+		if (this->shm) {
+			dstr_cat(&cmd, " --shm ");
+			dstr_cat(&cmd, name);
+		} else {
+			ssp_blog(LOG_WARNING,
+				 "Cannot create shm ring %s, using pipe.",
+				 name);
+		}
+	}
 
-	auto tpipe = os_process_pipe_create(cmd.array, "r");
+	auto tpipe = os_process_pipe_create(cmd.array, "rwa");
 	blog(LOG_INFO, "Start ssp-connector at: %s", cmd.array);
 	dstr_free(&cmd);
 
 	if (!tpipe) {
 		blog(LOG_WARNING, "Start ssp-connector failed.");
+		delete this->shm;
+		this->shm = nullptr;
 		return;
 	}
 	this->statusLock.lock();
 	this->running = true;
+	this->metaSeen = false;
 	this->pipe = tpipe;
+	// Control set before the connector was up.
+	if (this->streamStyle != style) {
+		ControlCmd ctl = {this->streamStyle};
+		msg_send(tpipe, SetStreamStyleCmd, 0, &ctl, sizeof(ctl));
+	}
+	if (this->videoPaused) {
+		msg_send(tpipe, PauseVideoCmd, 0, nullptr, 0);
+	}
+	if (this->dropNonIdr) {
+		ControlCmd ctl = {1};
+		msg_send(tpipe, DropNonIdrCmd, 0, &ctl, sizeof(ctl));
+	}
 
-	this->worker = std::thread(SSPClientIso::ReceiveThread, this);
+	this->connectorOk = false;
+	this->protocolError = false;
+
+	// Read until EOF, a connector blocked on a full pipe would not exit.
+	auto reactor = SspPipeReactor::instance();
+	auto closed = readers.closer();
+	reactor->add(
+		tpipe, SSP_PIPE_OUT, ip,
+		std::bind(&SSPClientIso::OnMessage, this, _1),
+		[this, closed]() {
+			if (this->running) {
+				blog(LOG_WARNING, "%s Receive error !",
+				     this->ip.c_str());
+			}
+			blog(LOG_INFO, "%s connector output closed",
+			     this->ip.c_str());
+			closed();
+		});
+	// Audio and replies, read apart from video so a big frame cannot
+	// delay them.
+	reactor->add(
+		tpipe, SSP_PIPE_AUX, ip,
+		[this](Message *msg) {
+			if (this->running) {
+				this->Dispatch(msg);
+			}
+		},
+		readers.closer());
+	reactor->add(tpipe, SSP_PIPE_ERR, ip, nullptr, readers.closer());
 	this->statusLock.unlock();
 }
 
-void *SSPClientIso::ReceiveThread(void *arg)
+void SSPClientIso::OnMessage(Message *msg)
 {
-	auto th = (SSPClientIso *)arg;
-	Message *msg = nullptr;
-	th->statusLock.lock();
-	auto pipe = th->pipe;
-	th->statusLock.unlock();
-
-#ifdef _WIN32
-	std::thread(dump_stderr, pipe).detach();
-#endif
-
-	// Use RAII to ensure message is freed
-	std::unique_ptr<Message, decltype(&msg_free)> initial_msg(
-		msg_recv(pipe), msg_free);
-	if (!initial_msg) {
-		blog(LOG_WARNING, "%s Receive error !", th->getIp().c_str());
-		return nullptr;
+	if (!connectorOk) {
+		if (msg->type == MessageType::ConnectorOkMsg) {
+			connectorOk = true;
+			// The connector maps the ring before it reports ok.
+			if (shm) {
+				shm->unlink();
+			}
+		} else if (!protocolError) {
+			blog(LOG_WARNING, "%s Protocol error !", ip.c_str());
+			protocolError = true;
+		}
+		return;
 	}
-	if (initial_msg->type != MessageType::ConnectorOkMsg) {
-		blog(LOG_WARNING, "%s Protocol error !", th->getIp().c_str());
-		return nullptr;
+	if (!running) {
+		return;
 	}
+	Dispatch(msg);
+}
 
-	while (th->running) {
-		// Use RAII to ensure message is freed
-		std::unique_ptr<Message, decltype(&msg_free)> msg(
-			msg_recv(pipe), msg_free);
-		if (!msg) {
-			blog(LOG_WARNING, "%s Receive error !",
-			     th->getIp().c_str());
-			break;
-		}
-
-		switch (msg->type) {
-		case MessageType::MetaDataMsg:
-			th->OnMetadata((Metadata *)msg->value);
-			break;
-		case MessageType::VideoDataMsg:
-			th->OnH264Data((VideoData *)msg->value);
-			break;
-		case MessageType::AudioDataMsg:
-			th->OnAudioData((AudioData *)msg->value);
-			break;
-		case MessageType::RecvBufferFullMsg:
-			th->OnRecvBufferFull();
-			break;
-		case MessageType::DisconnectMsg:
-			th->OnDisconnected();
-			break;
-		case MessageType::ConnectionConnectedMsg:
-			th->OnConnectionConnected();
-			break;
-		case MessageType::ExceptionMsg:
-			th->OnException((Message *)msg->value);
-			break;
-		default:
-			blog(LOG_WARNING, "Protocol error !");
-			break;
-		}
+void SSPClientIso::Dispatch(Message *msg)
+{
+	switch (msg->type) {
+	case MessageType::MetaDataMsg:
+		OnMetadata((Metadata *)msg->value);
+		break;
+	case MessageType::VideoDataMsg:
+		OnH264Data((VideoData *)msg->value);
+		break;
+	case MessageType::AudioDataMsg:
+		OnAudioData((AudioData *)msg->value);
+		break;
+	case MessageType::RecvBufferFullMsg:
+		OnRecvBufferFull();
+		break;
+	case MessageType::DisconnectMsg:
+		OnDisconnected();
+		break;
+	case MessageType::ConnectionConnectedMsg:
+		OnConnectionConnected();
+		break;
+	case MessageType::ExceptionMsg:
+		OnException((Message *)msg->value);
+		break;
+	case MessageType::ShmDataMsg:
+		OnShmData((ShmDoorbell *)msg->value);
+		break;
+	case MessageType::StatsMsg:
+		OnStats((ConnectorStats *)msg->value);
+		break;
+	default:
+		blog(LOG_WARNING, "Protocol error !");
+		break;
 	}
+}
 
-	blog(LOG_WARNING, "%s Receive thread exit !", th->getIp().c_str());
-	return nullptr;
+void SSPClientIso::OnShmData(ShmDoorbell *bell)
+{
+	if (!shm) {
+		blog(LOG_WARNING, "%s shm doorbell without ring !", ip.c_str());
+		return;
+	}
+	auto rec = (Message *)shm->at(bell->pos, bell->length);
+	if (!rec || rec->type == MessageType::ShmDataMsg ||
+	    sizeof(Message) + rec->length > bell->length) {
+		blog(LOG_WARNING, "%s shm record error !", ip.c_str());
+		return;
+	}
+	Dispatch(rec);
+	shm->release(bell->pos, bell->length);
 }
 
 void SSPClientIso::Restart()
 {
 	this->Stop();
-	emit this->Start();
+	this->Start();
 }
 
 void SSPClientIso::Stop()
@@ -261,19 +290,78 @@ void SSPClientIso::Stop()
 	}
 	this->statusLock.lock();
 	this->running = false;
+	auto tpipe = this->pipe;
+	// The connector exits on EOF, which closes all of its outputs.
+	if (tpipe) {
+		os_process_pipe_close_write(tpipe);
+	}
+	this->statusLock.unlock();
+	readers.wait();
+	this->statusLock.lock();
+	this->pipe = nullptr;
 	this->statusLock.unlock();
-	if (this->worker.joinable()) {
-		this->worker.join();
+	if (tpipe) {
+		os_process_pipe_destroy(tpipe);
 	}
-	if (this->pipe) {
-		os_process_pipe_destroy(this->pipe);
-		this->pipe = nullptr;
+	delete this->shm;
+	this->shm = nullptr;
+}
+
+bool SSPClientIso::sendControl(uint32_t type, const void *body,
+			       uint32_t length)
+{
+	std::lock_guard<std::mutex> lock(statusLock);
+	if (!pipe) {
+		return false;
+	}
+	return msg_send(pipe, type, 0, body, length);
+}
+
+void SSPClientIso::SetVideoPaused(bool paused)
+{
+	if (videoPaused.exchange(paused) == paused) {
+		return;
 	}
+	sendControl(paused ? PauseVideoCmd : ResumeVideoCmd, nullptr, 0);
+}
+
+void SSPClientIso::SetStreamStyle(uint32_t style)
+{
+	if (streamStyle.exchange(style) == style) {
+		return;
+	}
+	ControlCmd ctl = {style};
+	sendControl(SetStreamStyleCmd, &ctl, sizeof(ctl));
+}
+
+void SSPClientIso::SetDropNonIdr(bool drop)
+{
+	if (dropNonIdr.exchange(drop) == drop) {
+		return;
+	}
+	ControlCmd ctl = {drop ? 1u : 0u};
+	sendControl(DropNonIdrCmd, &ctl, sizeof(ctl));
+}
+
+void SSPClientIso::RequestStats()
+{
+	sendControl(StatsCmd, nullptr, 0);
+}
+
+void SSPClientIso::ReportQueueDepth(uint32_t depth)
+{
+	if (!updateCongestion(depth)) {
+		return;
+	}
+	ControlCmd ctl = {depth};
+	sendControl(QueueDepthCmd, &ctl, sizeof(ctl));
 }
 
 void SSPClientIso::OnRecvBufferFull()
 {
-	this->bufferFullCallback();
+	if (this->bufferFullCallback) {
+		this->bufferFullCallback();
+	}
 }
 
 void SSPClientIso::OnH264Data(VideoData *videoData)
@@ -285,10 +373,14 @@ void SSPClientIso::OnH264Data(VideoData *videoData)
 	video.type = videoData->type;
 	video.len = videoData->len;
 	video.data = videoData->data;
-	this->h264DataCallback(&video);
+	this->h264DataCallback(&video, &videoData->index);
 }
 void SSPClientIso::OnAudioData(AudioData *audioData)
 {
+	// Meta comes on the other pipe, the decoder needs it first.
+	if (!metaSeen) {
+		return;
+	}
 	struct imf::SspAudioData audio;
 	audio.ntp_timestamp = audioData->ntp_timestamp;
 	audio.pts = audioData->pts;
@@ -323,6 +415,7 @@ void SSPClientIso::OnMetadata(Metadata *metadata)
 	meta.timecode = metadata->meta.timecode;
 
 	this->metaCallback(&vmeta, &ameta, &meta);
+	metaSeen = true;
 }
 void SSPClientIso::OnDisconnected()
 {
@@ -336,41 +429,319 @@ void SSPClientIso::OnException(Message *exception)
 {
 	this->exceptionCallback(exception->type, (char *)exception->value);
 }
+void SSPClientIso::OnStats(ConnectorStats *connectorStats)
+{
+	if (!this->statsCallback) {
+		return;
+	}
+	SSPClientStats stats;
+	stats.video_frames = connectorStats->video_frames;
+	stats.video_bytes = connectorStats->video_bytes;
+	stats.video_dropped = connectorStats->video_dropped;
+	stats.video_shed = connectorStats->video_shed;
+	stats.audio_frames = connectorStats->audio_frames;
+	stats.audio_bytes = connectorStats->audio_bytes;
+	stats.stream_style = connectorStats->stream_style;
+	stats.paused = connectorStats->paused != 0;
+	stats.drop_non_idr = connectorStats->drop_non_idr != 0;
+	stats.recv_buffer_full = connectorStats->recv_buffer_full;
+	stats.writer_full = connectorStats->writer_full;
+	this->statsCallback(stats);
+}
+
+std::mutex SSPConnectorMux::instanceLock;
+std::shared_ptr<SSPConnectorMux> SSPConnectorMux::instance;
+uint32_t SSPConnectorMux::nextStream = 1;
+
+SSPConnectorMux::SSPConnectorMux(const QString &path)
+{
+	this->ssp_connector_path = path;
+	this->running = false;
+	this->pipe = nullptr;
+	this->writeClosed = false;
+	this->connectorOk = false;
+	this->protocolError = false;
+}
+
+bool SSPConnectorMux::start()
+{
+	struct dstr cmd;
+
+	dstr_init_copy(&cmd, ssp_connector_path.toStdString().c_str());
+	dstr_insert_ch(&cmd, 0, '\"');
+	dstr_cat(&cmd, "\" --mux --aux");
+
+	auto tpipe = os_process_pipe_create(cmd.array, "rwa");
+	blog(LOG_INFO, "Start shared ssp-connector at: %s", cmd.array);
+	dstr_free(&cmd);
+
+	if (!tpipe) {
+		blog(LOG_WARNING, "Start shared ssp-connector failed.");
+		return false;
+	}
+	this->pipe = tpipe;
+	this->running = true;
+	this->connectorOk = false;
+	this->protocolError = false;
+
+	auto reactor = SspPipeReactor::instance();
+	auto closed = readers.closer();
+	reactor->add(tpipe, SSP_PIPE_OUT, "shared ssp-connector",
+		     std::bind(&SSPConnectorMux::OnMessage, this, _1),
+		     [this, closed]() {
+			     this->OnClosed();
+			     closed();
+		     });
+	reactor->add(tpipe, SSP_PIPE_AUX, "shared ssp-connector",
+		     std::bind(&SSPConnectorMux::OnAuxMessage, this, _1),
+		     readers.closer());
+	// Long lived, its session log would fill the stderr pipe otherwise.
+	reactor->add(tpipe, SSP_PIPE_ERR, "shared ssp-connector", nullptr,
+		     readers.closer());
+	return true;
+}
+
+void SSPConnectorMux::stop()
+{
+	blog(LOG_INFO, "shared ssp-connector stopping...");
+	{
+		// Commands racing with this find the pipe closed
+		std::lock_guard<std::mutex> lock(writeLock);
+		this->running = false;
+		// The connector exits on EOF, which closes all of its outputs.
+		os_process_pipe_close_write(this->pipe);
+		writeClosed = true;
+	}
+	readers.wait();
+	os_process_pipe_destroy(this->pipe);
+	this->pipe = nullptr;
+}
+
+bool SSPConnectorMux::sendCommand(uint32_t type, uint32_t stream,
+				  const void *body, uint32_t length)
+{
+	std::lock_guard<std::mutex> lock(writeLock);
+	if (writeClosed) {
+		return false;
+	}
+	return msg_send(pipe, type, stream, body, length);
+}
+
+std::shared_ptr<SSPConnectorMux>
+SSPConnectorMux::AddSession(SSPClientMux *client, uint32_t *stream)
+{
+	std::shared_ptr<SSPConnectorMux> dead;
+	{
+		std::lock_guard<std::mutex> lock(instanceLock);
+		if (instance && !instance->running) {
+			// The connector died, its sessions were told so.
+			dead = std::move(instance);
+		}
+	}
+	if (dead) {
+		dead->stop();
+	}
+
+	std::lock_guard<std::mutex> lock(instanceLock);
+	if (!instance) {
+		std::shared_ptr<SSPConnectorMux> mux(
+			new SSPConnectorMux(client->ssp_connector_path));
+		if (!mux->start()) {
+			return nullptr;
+		}
+		instance = mux;
+	}
+	auto mux = instance;
+
+	// Ids are never reused, a stale client may still remove its old one.
+	*stream = nextStream++;
+	{
+		std::lock_guard<std::mutex> sessions_lock(mux->sessionsLock);
+		mux->sessions[*stream] =
+			std::make_shared<Session>(Session{client, 0});
+	}
 
-void SSPClientIso::setOnRecvBufferFullCallback(
-	const imf::OnRecvBufferFullCallback &cb)
+	SessionCmd cmd = {};
+	snprintf(cmd.host, sizeof(cmd.host), "%s", client->getIp().c_str());
+	cmd.port = 9999;
+	cmd.stream_style = client->streamStyle;
+	if (!mux->sendCommand(AddSessionCmd, *stream, &cmd, sizeof(cmd))) {
+		blog(LOG_WARNING, "%s add session failed !",
+		     client->getIp().c_str());
+		// Nothing was sent for it, so no callback can be running
+		std::lock_guard<std::mutex> sessions_lock(mux->sessionsLock);
+		mux->sessions.erase(*stream);
+		return nullptr;
+	}
+	if (client->videoPaused) {
+		mux->sendCommand(PauseVideoCmd, *stream, nullptr, 0);
+	}
+	if (client->dropNonIdr) {
+		ControlCmd ctl = {1};
+		mux->sendCommand(DropNonIdrCmd, *stream, &ctl, sizeof(ctl));
+	}
+	return mux;
+}
+
+void SSPConnectorMux::RemoveSession(const std::shared_ptr<SSPConnectorMux> &mux,
+				    uint32_t stream)
 {
-	this->bufferFullCallback = cb;
+	{
+		// Once erased no more callbacks reach the client, wait for
+		// the ones already running.
+		std::unique_lock<std::mutex> lock(mux->sessionsLock);
+		auto it = mux->sessions.find(stream);
+		if (it == mux->sessions.end()) {
+			return;
+		}
+		auto session = it->second;
+		mux->sessions.erase(it);
+		mux->sessionsIdle.wait(
+			lock, [&]() { return session->dispatching == 0; });
+	}
+	mux->sendCommand(RemoveSessionCmd, stream, nullptr, 0);
+
+	bool last = false;
+	{
+		std::lock_guard<std::mutex> lock(instanceLock);
+		std::lock_guard<std::mutex> sessions_lock(mux->sessionsLock);
+		if (instance == mux && mux->sessions.empty()) {
+			instance.reset();
+			last = true;
+		}
+	}
+	if (last) {
+		mux->stop();
+	}
 }
 
-void SSPClientIso::setOnAudioDataCallback(const imf::OnAudioDataCallback &cb)
+std::shared_ptr<SSPConnectorMux::Session>
+SSPConnectorMux::acquire(uint32_t stream)
 {
-	this->audioDataCallback = cb;
+	std::lock_guard<std::mutex> lock(sessionsLock);
+	auto it = sessions.find(stream);
+	if (it == sessions.end()) {
+		return nullptr;
+	}
+	it->second->dispatching++;
+	return it->second;
 }
 
-void SSPClientIso::setOnMetaCallback(const imf::OnMetaCallback &cb)
+void SSPConnectorMux::release(const std::shared_ptr<Session> &session)
 {
-	this->metaCallback = cb;
+	std::lock_guard<std::mutex> lock(sessionsLock);
+	if (--session->dispatching == 0) {
+		sessionsIdle.notify_all();
+	}
 }
 
-void SSPClientIso::setOnDisconnectedCallback(
-	const imf::OnDisconnectedCallback &cb)
+// Reads until EOF, the connector may still be sending frames of a session
+// that was just removed.
+void SSPConnectorMux::OnMessage(Message *msg)
 {
-	this->disconnectedCallback = cb;
+	if (!connectorOk) {
+		if (msg->type == MessageType::ConnectorOkMsg) {
+			connectorOk = true;
+		} else if (!protocolError) {
+			blog(LOG_WARNING,
+			     "shared ssp-connector protocol error !");
+			protocolError = true;
+		}
+		return;
+	}
+	auto session = acquire(msg->stream);
+	if (session) {
+		session->client->Dispatch(msg);
+		release(session);
+	}
 }
 
-void SSPClientIso::setOnConnectionConnectedCallback(
-	const imf::OnConnectionConnectedCallback &cb)
+void SSPConnectorMux::OnAuxMessage(Message *msg)
 {
-	this->connectedCallback = cb;
+	auto session = acquire(msg->stream);
+	if (session) {
+		session->client->Dispatch(msg);
+		release(session);
+	}
 }
 
-void SSPClientIso::setOnH264DataCallback(const imf::OnH264DataCallback &cb)
+void SSPConnectorMux::OnClosed()
 {
-	this->h264DataCallback = cb;
+	if (running.exchange(false)) {
+		blog(LOG_WARNING, "shared ssp-connector exited !");
+		std::vector<std::shared_ptr<Session>> active;
+		{
+			std::lock_guard<std::mutex> lock(sessionsLock);
+			for (auto &session : sessions) {
+				session.second->dispatching++;
+				active.push_back(session.second);
+			}
+		}
+		for (auto &session : active) {
+			session->client->OnDisconnected();
+			release(session);
+		}
+	}
+	blog(LOG_INFO, "shared ssp-connector output closed");
+}
+
+SSPClientMux::SSPClientMux(const std::string &ip, uint32_t bufferSize)
+	: SSPClientIso(ip, bufferSize)
+{
+	this->stream = 0;
+}
+
+SSPClientMux::~SSPClientMux()
+{
+	Stop();
+}
+
+void SSPClientMux::Start()
+{
+	std::lock_guard<std::mutex> lock(sessionLock);
+	if (stream) {
+		return;
+	}
+	blog(LOG_INFO, "Start shared ssp-connector session for %s",
+	     getIp().c_str());
+	metaSeen = false;
+	uint32_t id = 0;
+	mux = SSPConnectorMux::AddSession(this, &id);
+	stream = mux ? id : 0;
+}
+
+bool SSPClientMux::sendControl(uint32_t type, const void *body,
+			       uint32_t length)
+{
+	std::shared_ptr<SSPConnectorMux> target;
+	uint32_t id;
+	{
+		std::lock_guard<std::mutex> lock(sessionLock);
+		target = mux;
+		id = stream;
+	}
+	if (!target) {
+		return false;
+	}
+	return target->sendCommand(type, id, body, length);
 }
 
-void SSPClientIso::setOnExceptionCallback(const imf::OnExceptionCallback &cb)
+void SSPClientMux::Stop()
 {
-	this->exceptionCallback = cb;
+	std::shared_ptr<SSPConnectorMux> target;
+	uint32_t id;
+	{
+		std::lock_guard<std::mutex> lock(sessionLock);
+		blog(LOG_INFO, "ssp client %s stopping...", getIp().c_str());
+		if (!stream) {
+			blog(LOG_INFO, "ssp client %s already stopped...",
+			     getIp().c_str());
+			return;
+		}
+		target = std::move(mux);
+		id = stream;
+		stream = 0;
+	}
+	// Not under sessionLock, a running callback may need it to send
+	SSPConnectorMux::RemoveSession(target, id);
 }
@@ -21,13 +21,14 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #include <QObject>
 #include <QProcess>
 #include <mutex>
-#include <thread>
 #include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
 #include <imf/ISspClient.h>
-extern "C" {
-#include "util/pipe.h"
-}
-#include <ssp_connector_proto.h>
+#include "ssp-client.h"
+#include "ssp-pipe-reactor.h"
+#include <ssp_shm_ring.h>
 
 #ifdef _WIN64
 #define SSP_CONNECTOR "../../obs-plugins/" OBS_SSP_BITSTR "/ssp-connector.exe"
@@ -35,33 +36,35 @@ extern "C" {
 #define SSP_CONNECTOR "ssp-connector"
 #endif
 
-class SSPClientIso : public QObject {
+class SSPClientIso : public QObject, public SSPClient {
 	Q_OBJECT
 
 public:
 	SSPClientIso(const std::string &ip, uint32_t bufferSize);
 	~SSPClientIso();
-	virtual void
-	setOnRecvBufferFullCallback(const imf::OnRecvBufferFullCallback &cb);
-	virtual void setOnH264DataCallback(const imf::OnH264DataCallback &cb);
-	virtual void setOnAudioDataCallback(const imf::OnAudioDataCallback &cb);
-	virtual void setOnMetaCallback(const imf::OnMetaCallback &cb);
-	virtual void
-	setOnDisconnectedCallback(const imf::OnDisconnectedCallback &cb);
-	virtual void setOnConnectionConnectedCallback(
-		const imf::OnConnectionConnectedCallback &cb);
-	virtual void setOnExceptionCallback(const imf::OnExceptionCallback &cb);
-	void Stop();
-	void Restart();
-	static void *ReceiveThread(void *arg);
-	std::string getIp() { return ip; };
+	void setSharedMemory(bool enable) { useShm = enable; };
+	void Start() override { emit startRequested(); };
+	void Stop() override;
+	void Restart() override;
+	std::string getIp() override { return ip; };
+	void SetVideoPaused(bool paused) override;
+	void SetStreamStyle(uint32_t style) override;
+	void SetDropNonIdr(bool drop) override;
+	void RequestStats() override;
+	void ReportQueueDepth(uint32_t depth) override;
 signals:
-	void Start();
+	void startRequested();
 
 private slots:
 	void doStart();
 
-private:
+protected:
+	// Sends a command to the running connector, false when there is none.
+	virtual bool sendControl(uint32_t type, const void *body,
+				 uint32_t length);
+	void OnMessage(Message *msg);
+	void Dispatch(Message *msg);
+	void OnShmData(ShmDoorbell *bell);
 	virtual void OnRecvBufferFull();
 	virtual void OnH264Data(VideoData *video);
 	virtual void OnAudioData(AudioData *audio);
@@ -69,24 +72,104 @@ private:
 	virtual void OnDisconnected();
 	virtual void OnConnectionConnected();
 	virtual void OnException(Message *exception);
+	virtual void OnStats(ConnectorStats *stats);
+
+	QString ssp_connector_path;
+	// Audio is read on the aux thread, meta on the main one.
+	std::atomic<bool> metaSeen;
 
+private:
 	std::mutex statusLock;
 	std::atomic<bool> running;
 	std::string ip;
 	uint32_t bufferSize;
-	QString ssp_connector_path;
 
 	os_process_pipe_t *pipe;
+	bool useShm;
+	SspShmRing *shm;
+	// Reactor thread only
+	bool connectorOk;
+	bool protocolError;
+	SspPipeGroup readers;
+};
+
+class SSPClientMux;
+
+/*
+ * A single ssp-connector started with --mux, hosting the sessions of every
+ * SSPClientMux on one libuv loop. It is spawned with the first session and
+ * told to exit when the last one is removed. Messages carry the session id
+ * in Message::stream and are handed to the owning client here.
+ *
+ * Clients hold on to the connector their session is on. Lock order is
+ * instanceLock, then sessionsLock; callbacks run without either, so they
+ * may send commands, and whoever takes a connector out of instance stops
+ * it after letting go of the locks.
+ */
+class SSPConnectorMux {
+public:
+	// Returns the connector and the session id in stream, nullptr when
+	// the connector could not be started.
+	static std::shared_ptr<SSPConnectorMux> AddSession(SSPClientMux *client,
+							   uint32_t *stream);
+	// Returns once no callback of the session runs any more.
+	static void RemoveSession(const std::shared_ptr<SSPConnectorMux> &mux,
+				  uint32_t stream);
+	bool sendCommand(uint32_t type, uint32_t stream, const void *body,
+			 uint32_t length);
+
+private:
+	// dispatching counts the callbacks running on client.
+	struct Session {
+		SSPClientMux *client;
+		int dispatching;
+	};
 
-	std::thread worker;
+	explicit SSPConnectorMux(const QString &path);
+	bool start();
+	void stop();
+	std::shared_ptr<Session> acquire(uint32_t stream);
+	void release(const std::shared_ptr<Session> &session);
+	void OnMessage(Message *msg);
+	void OnAuxMessage(Message *msg);
+	void OnClosed();
+
+	static std::mutex instanceLock;
+	static std::shared_ptr<SSPConnectorMux> instance;
+	static uint32_t nextStream;
+
+	QString ssp_connector_path;
+	std::atomic<bool> running;
+	os_process_pipe_t *pipe;
+	std::mutex writeLock;
+	bool writeClosed; // under writeLock
+	std::mutex sessionsLock;
+	std::condition_variable sessionsIdle;
+	std::map<uint32_t, std::shared_ptr<Session>> sessions;
+	// Reactor thread only
+	bool connectorOk;
+	bool protocolError;
+	SspPipeGroup readers;
+};
+
+// One camera served by the shared connector.
+class SSPClientMux : public SSPClientIso {
+public:
+	SSPClientMux(const std::string &ip, uint32_t bufferSize);
+	~SSPClientMux();
+	void Start() override;
+	void Stop() override;
+
+protected:
+	bool sendControl(uint32_t type, const void *body,
+			 uint32_t length) override;
+
+private:
+	friend class SSPConnectorMux;
 
-	imf::OnRecvBufferFullCallback bufferFullCallback;
-	imf::OnH264DataCallback h264DataCallback;
-	imf::OnAudioDataCallback audioDataCallback;
-	imf::OnConnectionConnectedCallback connectedCallback;
-	imf::OnDisconnectedCallback disconnectedCallback;
-	imf::OnMetaCallback metaCallback;
-	imf::OnExceptionCallback exceptionCallback;
+	std::mutex sessionLock;
+	std::shared_ptr<SSPConnectorMux> mux;
+	uint32_t stream;
 };
 
 #endif //OBS_SSP_SSP_CLIENT_ISO_H
@@ -0,0 +1,135 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_SSP_CLIENT_H
+#define OBS_SSP_SSP_CLIENT_H
+#include <string>
+#include <atomic>
+#include <functional>
+#include <imf/ISspClient.h>
+#include <ssp_connector_proto.h>
+
+struct SSPClientStats {
+	uint64_t video_frames;
+	uint64_t video_bytes;
+	uint64_t video_dropped;
+	uint64_t video_shed;
+	uint64_t audio_frames;
+	uint64_t audio_bytes;
+	uint32_t stream_style;
+	bool paused;
+	bool drop_non_idr;
+	uint32_t recv_buffer_full;
+	uint32_t writer_full;
+};
+
+typedef std::function<void(const SSPClientStats &stats)> OnStatsCallback;
+// index is nullptr when the client has none for the frame.
+typedef std::function<void(imf::SspH264Data *video, const NalIndex *index)>
+	OnVideoDataCallback;
+
+// Common interface of the ways a source can receive an SSP stream.
+class SSPClient {
+public:
+	virtual ~SSPClient() = default;
+
+	virtual void Start() = 0;
+	virtual void Stop() = 0;
+	virtual void Restart() = 0;
+	virtual std::string getIp() = 0;
+
+	/*
+	 * Runtime control, takes effect without a reconnect. Settings made
+	 * before Start() are applied when the session comes up. Resuming
+	 * video waits for the next IDR frame.
+	 */
+	virtual void SetVideoPaused(bool paused) { videoPaused = paused; }
+	virtual void SetStreamStyle(uint32_t style) { streamStyle = style; }
+	virtual void SetDropNonIdr(bool drop) { dropNonIdr = drop; }
+	// Answered through the stats callback, possibly from another thread.
+	virtual void RequestStats() {}
+	// Frames waiting for the decoder, called after each video frame.
+	virtual void ReportQueueDepth(uint32_t depth)
+	{
+		updateCongestion(depth);
+	}
+	void setOnStatsCallback(const OnStatsCallback &cb) { statsCallback = cb; }
+
+	virtual void
+	setOnRecvBufferFullCallback(const imf::OnRecvBufferFullCallback &cb)
+	{
+		bufferFullCallback = cb;
+	}
+	virtual void setOnH264DataCallback(const OnVideoDataCallback &cb)
+	{
+		h264DataCallback = cb;
+	}
+	virtual void setOnAudioDataCallback(const imf::OnAudioDataCallback &cb)
+	{
+		audioDataCallback = cb;
+	}
+	virtual void setOnMetaCallback(const imf::OnMetaCallback &cb)
+	{
+		metaCallback = cb;
+	}
+	virtual void
+	setOnDisconnectedCallback(const imf::OnDisconnectedCallback &cb)
+	{
+		disconnectedCallback = cb;
+	}
+	virtual void setOnConnectionConnectedCallback(
+		const imf::OnConnectionConnectedCallback &cb)
+	{
+		connectedCallback = cb;
+	}
+	virtual void setOnExceptionCallback(const imf::OnExceptionCallback &cb)
+	{
+		exceptionCallback = cb;
+	}
+
+protected:
+	// True when depth crossed SSP_QUEUE_DEPTH_HIGH or _LOW.
+	bool updateCongestion(uint32_t depth)
+	{
+		bool congested;
+		if (depth >= SSP_QUEUE_DEPTH_HIGH) {
+			congested = true;
+		} else if (depth <= SSP_QUEUE_DEPTH_LOW) {
+			congested = false;
+		} else {
+			return false;
+		}
+		return queueCongested.exchange(congested) != congested;
+	}
+
+	imf::OnRecvBufferFullCallback bufferFullCallback;
+	OnVideoDataCallback h264DataCallback;
+	imf::OnAudioDataCallback audioDataCallback;
+	imf::OnConnectionConnectedCallback connectedCallback;
+	imf::OnDisconnectedCallback disconnectedCallback;
+	imf::OnMetaCallback metaCallback;
+	imf::OnExceptionCallback exceptionCallback;
+	OnStatsCallback statsCallback;
+
+	std::atomic<bool> videoPaused{false};
+	std::atomic<uint32_t> streamStyle{imf::STREAM_DEFAULT};
+	std::atomic<bool> dropNonIdr{false};
+	std::atomic<bool> queueCongested{false};
+};
+
+#endif //OBS_SSP_SSP_CLIENT_H
@@ -0,0 +1,757 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <obs.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "obs-ssp.h"
+#include "ssp-pipe-reactor.h"
+#include "ssp-uring.h"
+
+#define RECV_ARENA_MIN_SIZE (256 * 1024)
+#define RECV_ARENA_STATS_INTERVAL_NS (60 * 1000000000ULL)
+#define REACTOR_MAX_EVENTS 32
+#define REACTOR_URING_ENTRIES 256
+// Tags the user_data of cancellations, apart from channel ids
+#define REACTOR_CANCEL (1ULL << 63)
+// io_uring, epoll or threads, the default is the first that works
+#define REACTOR_BACKEND_ENV "SSP_PIPE_REACTOR"
+// One read never asks for more, the arena only grows to the largest message
+#define REACTOR_READ_MAX (64 * 1024 * 1024)
+
+typedef size_t (*pipe_read_t)(os_process_pipe_t *pp, uint8_t *data,
+			      size_t len);
+
+static size_t os_process_pipe_read_retry(os_process_pipe *pipe, uint8_t *dst,
+					 size_t size, pipe_read_t read)
+{
+	size_t pos = 0, cur = 0;
+	while (pos < size) {
+		cur = read(pipe, dst + pos, size - pos);
+		if (!cur) {
+			break;
+		}
+		pos += cur;
+	}
+	return pos;
+}
+
+static bool arena_reserve(SspRecvArena *arena, size_t size)
+{
+	if (size <= arena->capacity) {
+		return true;
+	}
+	size_t capacity = arena->capacity ? arena->capacity
+					   : RECV_ARENA_MIN_SIZE;
+	while (capacity < size) {
+		capacity *= 2;
+	}
+	auto buf = (uint8_t *)brealloc(arena->buf, capacity);
+	if (!buf) {
+		return false;
+	}
+	arena->buf = buf;
+	arena->capacity = capacity;
+	arena->allocs++;
+	return true;
+}
+
+static void arena_free(SspRecvArena *arena)
+{
+	bfree(arena->buf);
+	arena->buf = nullptr;
+	arena->capacity = 0;
+}
+
+static void arena_stats(SspRecvArena *arena, const std::string &name)
+{
+	uint64_t now = os_gettime_ns();
+	if (!arena->stats_start) {
+		arena->stats_start = now;
+		arena->stats_allocs = arena->allocs;
+		return;
+	}
+	uint64_t elapsed = now - arena->stats_start;
+	if (elapsed < RECV_ARENA_STATS_INTERVAL_NS) {
+		return;
+	}
+	arena->alloc_rate = (double)(arena->allocs - arena->stats_allocs) *
+			    1000000000.0 / (double)elapsed;
+	arena->stats_start = now;
+	arena->stats_allocs = arena->allocs;
+	ssp_blog(LOG_INFO, "%s recv arena: %.3f allocs/s, capacity %zu",
+		 name.c_str(), arena->alloc_rate, arena->capacity);
+}
+
+/*
+ * Blocking read of the next message into the arena. The returned message
+ * stays valid until the next call. nullptr at EOF or on a short read.
+ */
+static Message *msg_recv(os_process_pipe *pipe, SspRecvArena *arena,
+			 pipe_read_t read)
+{
+	size_t sz = 0;
+	if (!arena_reserve(arena, sizeof(Message))) {
+		return nullptr;
+	}
+	sz = os_process_pipe_read_retry(pipe, arena->buf, sizeof(Message),
+					read);
+	if (sz != sizeof(Message)) {
+		if (sz) {
+			ssp_blog(LOG_WARNING,
+				 "pipe protocol header error, recv: %zu!", sz);
+		}
+		return nullptr;
+	}
+	uint32_t length = ((Message *)arena->buf)->length;
+	if (length == 0) {
+		return (Message *)arena->buf;
+	}
+	if (!arena_reserve(arena, sizeof(Message) + length)) {
+		ssp_blog(LOG_WARNING, "pipe protocol body too large: %u!",
+			 length);
+		return nullptr;
+	}
+	Message *msg = (Message *)arena->buf;
+	sz = os_process_pipe_read_retry(pipe, msg->value, msg->length, read);
+	if (sz != msg->length) {
+		ssp_blog(LOG_WARNING, "pipe protocol body error, recv: %zu!",
+			 sz);
+		return nullptr;
+	}
+	return msg;
+}
+
+std::mutex SspPipeReactor::instanceLock;
+SspPipeReactor *SspPipeReactor::s_instance = nullptr;
+
+SspPipeReactor *SspPipeReactor::instance()
+{
+	std::lock_guard<std::mutex> lock(instanceLock);
+	if (!s_instance) {
+		s_instance = new SspPipeReactor;
+	}
+	return s_instance;
+}
+
+void SspPipeReactor::destroyInstance()
+{
+	std::lock_guard<std::mutex> lock(instanceLock);
+	delete s_instance;
+	s_instance = nullptr;
+}
+
+SspPipeReactor::SspPipeReactor()
+{
+	epfd = -1;
+	wakefd = -1;
+	uring = nullptr;
+	nextId = 1; // 0 is the wake event
+	loopExited = false;
+	stopping = false;
+	wakeValue = 0;
+	wakeReading = false;
+	statsStart = 0;
+	statsBytes = 0;
+	statsMessages = 0;
+	statsReads = 0;
+	statsSyscalls = 0;
+	statsLogged = {};
+#ifdef __linux__
+	// Forcing a backend is for comparing them, see benchmarks/
+	const char *want = getenv(REACTOR_BACKEND_ENV);
+	if (want && !strcmp(want, "threads")) {
+		ssp_blog(LOG_INFO, "%s=%s, reading connector pipes on threads",
+			 REACTOR_BACKEND_ENV, want);
+		return;
+	}
+	// Blocking, io_uring would fail reads of it with EAGAIN otherwise
+	wakefd = eventfd(0, EFD_CLOEXEC);
+	if (wakefd < 0) {
+		ssp_blog(LOG_WARNING,
+			 "eventfd unavailable, reading connector pipes on "
+			 "threads");
+		return;
+	}
+#ifdef SSP_HAVE_IO_URING
+	if (!want || strcmp(want, "epoll") != 0) {
+		uring = new SspUring;
+		if (uring->init(REACTOR_URING_ENTRIES)) {
+			thread = std::thread(&SspPipeReactor::uringLoop, this);
+			return;
+		}
+		delete uring;
+		uring = nullptr;
+		ssp_blog(LOG_INFO, "io_uring reads unavailable, reading "
+				   "connector pipes with epoll");
+	}
+#endif
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd >= 0) {
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) == 0) {
+			thread = std::thread(&SspPipeReactor::epollLoop, this);
+			return;
+		}
+		::close(epfd);
+		epfd = -1;
+	}
+	ssp_blog(LOG_WARNING,
+		 "epoll unavailable, reading connector pipes on threads");
+	::close(wakefd);
+	wakefd = -1;
+#endif
+}
+
+SspPipeReactor::~SspPipeReactor()
+{
+#ifdef __linux__
+	if (thread.joinable()) {
+		stopping = true;
+		uint64_t one = 1;
+		if (write(wakefd, &one, sizeof(one)) != sizeof(one)) {
+			ssp_blog(LOG_WARNING, "cannot wake the pipe reactor");
+		}
+		thread.join();
+		if (epfd >= 0) {
+			::close(epfd);
+		}
+		::close(wakefd);
+	}
+#ifdef SSP_HAVE_IO_URING
+	delete uring;
+#endif
+#endif
+	for (auto &it : channels) {
+		arena_free(&it.second->arena);
+	}
+	for (auto &c : abandoned) {
+		arena_free(&c->arena);
+	}
+}
+
+bool SspPipeReactor::add(os_process_pipe_t *pipe, SspPipeChannel channel,
+			 const std::string &name, MessageFunc onMessage,
+			 CloseFunc onClose)
+{
+	auto c = new Channel;
+	c->fd = -1;
+	c->kind = channel;
+	c->name = name;
+	c->onMessage = std::move(onMessage);
+	c->onClose = std::move(onClose);
+	c->start = 0;
+	c->end = 0;
+	c->reading = false;
+
+#ifdef __linux__
+	if (thread.joinable()) {
+		int fd = os_process_pipe_get_err_fd(pipe);
+		if (channel == SSP_PIPE_OUT) {
+			fd = os_process_pipe_get_fd(pipe);
+		} else if (channel == SSP_PIPE_AUX) {
+			fd = os_process_pipe_get_aux_fd(pipe);
+		}
+		bool watched = false;
+		bool exited;
+		{
+			// Held until the channel is in the map, events for it
+			// wait on the lock.
+			std::lock_guard<std::mutex> lock(channelsLock);
+			exited = loopExited;
+			if (fd >= 0 && !exited && uring) {
+				// Blocking, io_uring polls it itself
+				fcntl(fd, F_SETFL,
+				      fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+				c->fd = fd;
+				uint64_t id = nextId++;
+				channels[id].reset(c);
+				pending.push_back(id);
+				watched = true;
+			} else if (fd >= 0 && !exited) {
+				fcntl(fd, F_SETFL,
+				      fcntl(fd, F_GETFL) | O_NONBLOCK);
+				c->fd = fd;
+				uint64_t id = nextId++;
+				struct epoll_event ev = {};
+				ev.events = EPOLLIN;
+				ev.data.u64 = id;
+				if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) ==
+				    0) {
+					channels[id].reset(c);
+					watched = true;
+				}
+			}
+		}
+		if (watched && uring) {
+			uint64_t one = 1;
+			if (write(wakefd, &one, sizeof(one)) != sizeof(one)) {
+				ssp_blog(LOG_WARNING,
+					 "cannot wake the pipe reactor");
+			}
+		}
+		if (watched) {
+			return true;
+		}
+		if (!exited) {
+			ssp_blog(LOG_WARNING,
+				 "%s cannot watch connector pipe %d",
+				 name.c_str(), (int)channel);
+			CloseFunc done = std::move(c->onClose);
+			delete c;
+			done();
+			return false;
+		}
+		// The reactor thread failed, read this one the old way
+	}
+#endif
+	std::thread(readBlocking, pipe, c).detach();
+	return true;
+}
+
+#ifdef __linux__
+void SspPipeReactor::epollLoop()
+{
+	os_set_thread_name("ssp-pipe-read");
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	while (true) {
+		int n = epoll_wait(epfd, events, REACTOR_MAX_EVENTS, -1);
+		statsSyscalls++;
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ssp_blog(LOG_ERROR, "pipe reactor wait failed: %d",
+				 errno);
+			break;
+		}
+		// One read per ready channel and round, so a camera sending
+		// a burst cannot starve the others.
+		bool stop = false;
+		for (int i = 0; i < n && !stop; ++i) {
+			uint64_t id = events[i].data.u64;
+			if (id == 0) {
+				stop = true;
+				continue;
+			}
+			Channel *c = find(id);
+			if (c && !readChannel(c)) {
+				finish(id);
+			}
+		}
+		if (stop) {
+			break;
+		}
+		logStats();
+	}
+	closeAll();
+}
+
+// False at EOF or on an error.
+bool SspPipeReactor::readChannel(Channel *c)
+{
+	uint8_t *buf;
+	size_t len;
+	if (!prepareRead(c, &buf, &len)) {
+		return false;
+	}
+	ssize_t n = read(c->fd, buf, len);
+	statsSyscalls++;
+	if (n == 0) {
+		return false;
+	}
+	if (n < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK ||
+		       errno == EINTR;
+	}
+	received(c, (size_t)n);
+	return true;
+}
+
+/*
+ * Every channel has exactly one read in flight, so a camera sending a burst
+ * gets one completion per round like the others. A round is one
+ * io_uring_enter that submits the reads queued by the previous round and
+ * waits for the next completions.
+ */
+void SspPipeReactor::uringLoop()
+{
+	os_set_thread_name("ssp-pipe-read");
+#ifdef SSP_HAVE_IO_URING
+	wakeReading = uring->read(wakefd, &wakeValue, sizeof(wakeValue), 0);
+	while (wakeReading) {
+		if (!uring->submitAndWait()) {
+			ssp_blog(LOG_ERROR, "pipe reactor wait failed: %d",
+				 errno);
+			break;
+		}
+		bool stop = false;
+		uring->reap([&](uint64_t id, int res) {
+			if (id != 0) {
+				completed(id, res);
+				return;
+			}
+			wakeReading = false;
+			if (stopping) {
+				stop = true;
+			} else if (res < 0 && res != -EINTR && res != -EAGAIN) {
+				// Nothing could be added any more
+				ssp_blog(LOG_ERROR,
+					 "pipe reactor wake read failed: %d",
+					 -res);
+				stop = true;
+			} else {
+				startPending();
+				wakeReading = uring->read(wakefd, &wakeValue,
+							  sizeof(wakeValue),
+							  0);
+			}
+		});
+		if (stop) {
+			break;
+		}
+		logStats();
+	}
+#endif
+	closeAll();
+}
+
+void SspPipeReactor::startPending()
+{
+	std::vector<uint64_t> ids;
+	{
+		std::lock_guard<std::mutex> lock(channelsLock);
+		ids.swap(pending);
+	}
+	for (uint64_t id : ids) {
+		Channel *c = find(id);
+		if (c) {
+			submitRead(id, c);
+		}
+	}
+}
+
+void SspPipeReactor::submitRead(uint64_t id, Channel *c)
+{
+#ifdef SSP_HAVE_IO_URING
+	uint8_t *buf;
+	size_t len;
+	if (!prepareRead(c, &buf, &len) ||
+	    !uring->read(c->fd, buf, (unsigned)len, id)) {
+		finish(id);
+		return;
+	}
+	c->reading = true;
+#else
+	UNUSED_PARAMETER(c);
+	finish(id);
+#endif
+}
+
+void SspPipeReactor::completed(uint64_t id, int res)
+{
+	Channel *c = find(id);
+	if (!c) {
+		return;
+	}
+	c->reading = false;
+	if (res > 0) {
+		received(c, (size_t)res);
+		submitRead(id, c);
+	} else if (res == -EINTR || res == -EAGAIN) {
+		submitRead(id, c);
+	} else {
+		if (res < 0) {
+			ssp_blog(LOG_WARNING, "%s pipe read failed: %d",
+				 c->name.c_str(), -res);
+		}
+		finish(id);
+	}
+}
+
+// Only the reactor thread removes channels, the pointer stays valid on it.
+SspPipeReactor::Channel *SspPipeReactor::find(uint64_t id)
+{
+	std::lock_guard<std::mutex> lock(channelsLock);
+	auto it = channels.find(id);
+	return it == channels.end() ? nullptr : it->second.get();
+}
+
+/*
+ * Where the next read goes. The message still incomplete is kept at the
+ * front when it would not fit after the bytes already dispatched, so the
+ * buffer only has to hold the largest message, like the blocking reader's
+ * arena. False when that message is too large.
+ */
+bool SspPipeReactor::prepareRead(Channel *c, uint8_t **buf, size_t *len)
+{
+	if (c->kind == SSP_PIPE_ERR) {
+		*buf = (uint8_t *)c->log;
+		*len = sizeof(c->log) - 1;
+		return true;
+	}
+	SspRecvArena *arena = &c->arena;
+	size_t have = c->end - c->start;
+	size_t need = sizeof(Message);
+	if (have >= sizeof(Message)) {
+		need += ((Message *)(arena->buf + c->start))->length;
+	}
+	if (c->start && c->start + need > arena->capacity) {
+		memmove(arena->buf, arena->buf + c->start, have);
+		c->start = 0;
+		c->end = have;
+	}
+	if (!arena_reserve(arena, c->start + need)) {
+		ssp_blog(LOG_WARNING, "%s pipe protocol body too large: %zu!",
+			 c->name.c_str(), need);
+		return false;
+	}
+	*buf = arena->buf + c->end;
+	*len = arena->capacity - c->end;
+	if (*len > REACTOR_READ_MAX) {
+		*len = REACTOR_READ_MAX;
+	}
+	return true;
+}
+
+// Takes n bytes read into the buffer from prepareRead.
+void SspPipeReactor::received(Channel *c, size_t n)
+{
+	statsBytes += n;
+	statsReads++;
+	if (c->kind == SSP_PIPE_ERR) {
+		c->log[n] = '\0';
+		ssp_blog(LOG_INFO, "%s", c->log);
+		return;
+	}
+
+	SspRecvArena *arena = &c->arena;
+	c->end += n;
+	while (c->end - c->start >= sizeof(Message)) {
+		auto msg = (Message *)(arena->buf + c->start);
+		size_t len = sizeof(Message) + msg->length;
+		if (c->end - c->start < len) {
+			break;
+		}
+		c->onMessage(msg);
+		c->start += len;
+		statsMessages++;
+	}
+	if (c->start == c->end) {
+		c->start = 0;
+		c->end = 0;
+	}
+	if (c->kind == SSP_PIPE_OUT) {
+		arena_stats(arena, c->name);
+	}
+}
+
+// Not watched or read any more before onClose, the owner closes the fd after.
+void SspPipeReactor::finish(uint64_t id)
+{
+	std::unique_ptr<Channel> c;
+	{
+		std::lock_guard<std::mutex> lock(channelsLock);
+		auto it = channels.find(id);
+		if (it == channels.end()) {
+			return;
+		}
+		c = std::move(it->second);
+		channels.erase(it);
+	}
+	if (c->end != c->start) {
+		ssp_blog(LOG_WARNING,
+			 "%s pipe closed inside a message, %zu bytes",
+			 c->name.c_str(), c->end - c->start);
+	}
+	if (epfd >= 0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, nullptr);
+	}
+	if (c->reading) {
+		// The kernel may still write into it, freed after the ring
+		ssp_blog(LOG_WARNING, "%s read could not be cancelled",
+			 c->name.c_str());
+		CloseFunc done = std::move(c->onClose);
+		{
+			std::lock_guard<std::mutex> lock(channelsLock);
+			abandoned.push_back(std::move(c));
+		}
+		done();
+		return;
+	}
+	arena_free(&c->arena);
+	c->onClose();
+}
+
+/*
+ * The reactor thread is about to return, on failure or when the reactor
+ * is destroyed. Every channel still open is closed so its owner does not
+ * wait for it forever, later ones are read on threads.
+ */
+void SspPipeReactor::closeAll()
+{
+	std::vector<uint64_t> ids;
+	{
+		std::lock_guard<std::mutex> lock(channelsLock);
+		loopExited = true;
+		pending.clear();
+		for (auto &it : channels) {
+			ids.push_back(it.first);
+		}
+	}
+	cancelReads();
+	for (uint64_t id : ids) {
+		finish(id);
+	}
+}
+
+// Reads in flight point into the channels, take them back first.
+void SspPipeReactor::cancelReads()
+{
+#ifdef SSP_HAVE_IO_URING
+	if (!uring) {
+		return;
+	}
+	auto inFlight = [this]() {
+		std::lock_guard<std::mutex> lock(channelsLock);
+		int n = wakeReading ? 1 : 0;
+		for (auto &it : channels) {
+			n += it.second->reading ? 1 : 0;
+		}
+		return n;
+	};
+	if (wakeReading) {
+		uring->cancel(0, REACTOR_CANCEL);
+	}
+	{
+		std::lock_guard<std::mutex> lock(channelsLock);
+		for (auto &it : channels) {
+			if (it.second->reading) {
+				uring->cancel(it.first,
+					      REACTOR_CANCEL | it.first);
+			}
+		}
+	}
+	while (inFlight() > 0 && uring->submitAndWait()) {
+		uring->reap([this](uint64_t id, int res) {
+			UNUSED_PARAMETER(res);
+			if (id & REACTOR_CANCEL) {
+				return;
+			}
+			if (id == 0) {
+				wakeReading = false;
+				return;
+			}
+			Channel *c = find(id);
+			if (c) {
+				// Data that made it in is dropped with it
+				c->reading = false;
+			}
+		});
+	}
+#endif
+}
+
+void SspPipeReactor::logStats()
+{
+	uint64_t now = os_gettime_ns();
+	if (!statsStart) {
+		statsStart = now;
+		return;
+	}
+	uint64_t elapsed = now - statsStart;
+	if (elapsed < RECV_ARENA_STATS_INTERVAL_NS) {
+		return;
+	}
+	Stats total = stats();
+	Stats &last = statsLogged;
+	double secs = (double)elapsed / 1000000000.0;
+	ssp_blog(LOG_INFO,
+		 "pipe reactor (%s): %.1f Mbps, %.0f msgs/s, %.0f reads/s, "
+		 "%.0f syscalls/s",
+		 backend(),
+		 (double)(total.bytes - last.bytes) * 8.0 / 1000000.0 / secs,
+		 (double)(total.messages - last.messages) / secs,
+		 (double)(total.reads - last.reads) / secs,
+		 (double)(total.syscalls - last.syscalls) / secs);
+	statsStart = now;
+	statsLogged = total;
+}
+#endif
+
+SspPipeReactor::Stats SspPipeReactor::stats()
+{
+	Stats s = {statsBytes, statsMessages, statsReads, statsSyscalls};
+#ifdef SSP_HAVE_IO_URING
+	if (uring) {
+		s.syscalls += uring->entered();
+	}
+#endif
+	return s;
+}
+
+const char *SspPipeReactor::backend()
+{
+	if (uring) {
+		return "io_uring";
+	}
+	return epfd >= 0 ? "epoll" : "threads";
+}
+
+// Fallback without epoll: one blocking reader per channel, until EOF.
+void SspPipeReactor::readBlocking(os_process_pipe_t *pipe, Channel *c)
+{
+	if (c->kind == SSP_PIPE_ERR) {
+		char buf[PIPE_LOG_MAX];
+		size_t sz;
+		while ((sz = os_process_pipe_read_err(pipe, (uint8_t *)buf,
+						      sizeof(buf) - 1)) != 0) {
+			buf[sz] = '\0';
+			ssp_blog(LOG_INFO, "%s", buf);
+		}
+	} else {
+		pipe_read_t readFn = c->kind == SSP_PIPE_AUX
+					     ? os_process_pipe_read_aux
+					     : os_process_pipe_read;
+		Message *msg;
+		while ((msg = msg_recv(pipe, &c->arena, readFn)) != nullptr) {
+			c->onMessage(msg);
+			if (c->kind == SSP_PIPE_OUT) {
+				arena_stats(&c->arena, c->name);
+			}
+		}
+	}
+	arena_free(&c->arena);
+	CloseFunc done = std::move(c->onClose);
+	delete c;
+	done();
+}
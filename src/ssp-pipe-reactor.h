@@ -0,0 +1,185 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_SSP_PIPE_REACTOR_H
+#define OBS_SSP_SSP_PIPE_REACTOR_H
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+extern "C" {
+#include "util/pipe.h"
+}
+#include <ssp_connector_proto.h>
+
+// Reusable receive buffer, grows to the largest message seen.
+struct SspRecvArena {
+	uint8_t *buf = nullptr;
+	size_t capacity = 0;
+	uint64_t allocs = 0;
+	uint64_t stats_start = 0;
+	uint64_t stats_allocs = 0;
+	double alloc_rate = 0.0;
+};
+
+enum SspPipeChannel {
+	SSP_PIPE_OUT, // stdout, Message records
+	SSP_PIPE_AUX, // aux pipe, Message records
+	SSP_PIPE_ERR, // stderr, logged
+};
+
+#define PIPE_LOG_MAX 1024
+
+class SspUring;
+
+/*
+ * Reads the output of every ssp-connector. On Linux a single thread keeps one
+ * large read per pipe in flight on io_uring, or waits on all of them with
+ * epoll when io_uring is not available, frames Message records as the bytes
+ * come in and hands complete ones to the owner; stderr is logged from the
+ * same thread. Elsewhere each channel gets a blocking reader thread behind
+ * the same interface.
+ *
+ * Callbacks run on the reader thread and must not wait for the connector.
+ * A channel lives until EOF. onClose is its last callback, always called,
+ * and the owner has to wait for it before destroying the pipe.
+ */
+class SspPipeReactor {
+public:
+	// msg is only valid during the call.
+	typedef std::function<void(Message *msg)> MessageFunc;
+	typedef std::function<void()> CloseFunc;
+
+	// Totals since the reactor thread started, 0 without one.
+	struct Stats {
+		uint64_t bytes;
+		uint64_t messages;
+		uint64_t reads;
+		uint64_t syscalls;
+	};
+
+	static SspPipeReactor *instance();
+	static void destroyInstance();
+
+	// onMessage is unused for SSP_PIPE_ERR. False when the channel could
+	// not be watched, onClose has been called already then.
+	bool add(os_process_pipe_t *pipe, SspPipeChannel channel,
+		 const std::string &name, MessageFunc onMessage,
+		 CloseFunc onClose);
+	Stats stats();
+	// "io_uring", "epoll" or "threads"
+	const char *backend();
+
+private:
+	struct Channel {
+		int fd;
+		SspPipeChannel kind;
+		std::string name;
+		MessageFunc onMessage;
+		CloseFunc onClose;
+		SspRecvArena arena;
+		size_t start; // first byte not dispatched yet
+		size_t end;   // end of what was read
+		char log[PIPE_LOG_MAX];
+		bool reading; // an io_uring read into it is in flight
+	};
+
+	SspPipeReactor();
+	~SspPipeReactor();
+#ifdef __linux__
+	void epollLoop();
+	bool readChannel(Channel *c);
+	void uringLoop();
+	void startPending();
+	void submitRead(uint64_t id, Channel *c);
+	void completed(uint64_t id, int res);
+	Channel *find(uint64_t id);
+	bool prepareRead(Channel *c, uint8_t **buf, size_t *len);
+	void received(Channel *c, size_t n);
+	void finish(uint64_t id);
+	void closeAll();
+	void cancelReads();
+	void logStats();
+#endif
+	static void readBlocking(os_process_pipe_t *pipe, Channel *c);
+
+	int epfd;
+	int wakefd;
+	SspUring *uring;
+	std::thread thread;
+	std::mutex channelsLock;
+	std::map<uint64_t, std::unique_ptr<Channel>> channels;
+	// Added but not read yet, io_uring reads are queued by the reactor
+	std::vector<uint64_t> pending;
+	// Closed with a read that could not be cancelled, the kernel may
+	// still write into them until the ring is gone
+	std::vector<std::unique_ptr<Channel>> abandoned;
+	uint64_t nextId;
+	// The reactor thread is done, channels get a thread of their own
+	bool loopExited; // under channelsLock
+	std::atomic<bool> stopping;
+	uint64_t wakeValue;
+	bool wakeReading;
+
+	// Written by the reactor thread only
+	std::atomic<uint64_t> statsBytes;
+	std::atomic<uint64_t> statsMessages;
+	std::atomic<uint64_t> statsReads;
+	std::atomic<uint64_t> statsSyscalls;
+	// Reactor thread only, when and at what the last stats were logged
+	uint64_t statsStart;
+	Stats statsLogged;
+
+	static std::mutex instanceLock;
+	static SspPipeReactor *s_instance;
+};
+
+// The channels of one connector, for waiting until all of them closed.
+class SspPipeGroup {
+public:
+	// Counts a channel as open, the returned function closes it.
+	SspPipeReactor::CloseFunc closer()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		open++;
+		return [this]() {
+			std::lock_guard<std::mutex> lock(mutex);
+			open--;
+			cond.notify_all();
+		};
+	}
+
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cond.wait(lock, [this]() { return open == 0; });
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable cond;
+	int open = 0;
+};
+
+#endif //OBS_SSP_SSP_PIPE_REACTOR_H
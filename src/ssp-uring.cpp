@@ -0,0 +1,206 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "ssp-uring.h"
+
+#ifdef SSP_HAVE_IO_URING
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+SspUring::SspUring()
+{
+	ringFd = -1;
+	sqRing = MAP_FAILED;
+	cqRing = MAP_FAILED;
+	sqes = (struct io_uring_sqe *)MAP_FAILED;
+	sqRingSize = 0;
+	cqRingSize = 0;
+	sqesSize = 0;
+	queued = 0;
+	enters = 0;
+}
+
+SspUring::~SspUring()
+{
+	if (sqes != MAP_FAILED) {
+		munmap(sqes, sqesSize);
+	}
+	if (cqRing != MAP_FAILED && cqRing != sqRing) {
+		munmap(cqRing, cqRingSize);
+	}
+	if (sqRing != MAP_FAILED) {
+		munmap(sqRing, sqRingSize);
+	}
+	if (ringFd >= 0) {
+		close(ringFd);
+	}
+}
+
+bool SspUring::init(unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ringFd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (ringFd < 0) {
+		return false;
+	}
+
+	sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single && cqRingSize > sqRingSize) {
+		sqRingSize = cqRingSize;
+	}
+	sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	if (sqRing == MAP_FAILED) {
+		return false;
+	}
+	if (single) {
+		cqRing = sqRing;
+	} else {
+		cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, ringFd,
+			      IORING_OFF_CQ_RING);
+		if (cqRing == MAP_FAILED) {
+			return false;
+		}
+	}
+	sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe *)mmap(nullptr, sqesSize,
+					    PROT_READ | PROT_WRITE,
+					    MAP_SHARED | MAP_POPULATE, ringFd,
+					    IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		return false;
+	}
+
+	auto sq = (uint8_t *)sqRing;
+	sqHead = (unsigned *)(sq + p.sq_off.head);
+	sqTail = (unsigned *)(sq + p.sq_off.tail);
+	sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+	sqArray = (unsigned *)(sq + p.sq_off.array);
+	sqEntries = p.sq_entries;
+	auto cq = (uint8_t *)cqRing;
+	cqHead = (unsigned *)(cq + p.cq_off.head);
+	cqTail = (unsigned *)(cq + p.cq_off.tail);
+	cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return canRead();
+}
+
+// Kernels before 5.6 set up a ring but fail every read with EINVAL. The
+// probe came with 5.6 as well, so a kernel without it cannot read either.
+bool SspUring::canRead()
+{
+	const unsigned ops = 256;
+	size_t size = sizeof(struct io_uring_probe) +
+		      ops * sizeof(struct io_uring_probe_op);
+	auto probe = (struct io_uring_probe *)calloc(1, size);
+	if (!probe) {
+		return false;
+	}
+	int ret = (int)syscall(__NR_io_uring_register, ringFd,
+			       IORING_REGISTER_PROBE, probe, ops);
+	bool supported = ret >= 0 && probe->last_op >= IORING_OP_READ &&
+			 (probe->ops[IORING_OP_READ].flags &
+			  IO_URING_OP_SUPPORTED);
+	free(probe);
+	return supported;
+}
+
+bool SspUring::enter(unsigned submit, unsigned wait)
+{
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	while (true) {
+		enters++;
+		int ret = (int)syscall(__NR_io_uring_enter, ringFd, submit,
+				       wait, flags, nullptr, 0);
+		if (ret >= 0) {
+			unsigned done = (unsigned)ret;
+			queued -= done < queued ? done : queued;
+			return true;
+		}
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+}
+
+// The next free entry, cleared, nullptr when the queue cannot be submitted.
+struct io_uring_sqe *SspUring::next()
+{
+	unsigned tail = *sqTail;
+	if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+		if (!enter(queued, 0)) {
+			return nullptr;
+		}
+	}
+	struct io_uring_sqe *sqe = &sqes[tail & *sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+void SspUring::push(struct io_uring_sqe *sqe)
+{
+	unsigned tail = *sqTail;
+	unsigned index = tail & *sqMask;
+	sqArray[index] = (unsigned)(sqe - sqes);
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+	queued++;
+}
+
+bool SspUring::read(int fd, void *buf, unsigned len, uint64_t data)
+{
+	struct io_uring_sqe *sqe = next();
+	if (!sqe) {
+		return false;
+	}
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1; // current position, pipes have none
+	sqe->user_data = data;
+	push(sqe);
+	return true;
+}
+
+bool SspUring::cancel(uint64_t target, uint64_t data)
+{
+	struct io_uring_sqe *sqe = next();
+	if (!sqe) {
+		return false;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = data;
+	push(sqe);
+	return true;
+}
+
+bool SspUring::submitAndWait()
+{
+	return enter(queued, 1);
+}
+#endif
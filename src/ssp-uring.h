@@ -0,0 +1,98 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_SSP_URING_H
+#define OBS_SSP_SSP_URING_H
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SSP_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef SSP_HAVE_IO_URING
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <linux/io_uring.h>
+
+/*
+ * The few io_uring calls the pipe reactor needs, on the raw syscalls so
+ * there is no liburing dependency. Reads only, one thread only.
+ */
+class SspUring {
+public:
+	SspUring();
+	~SspUring();
+	// False when the kernel has no io_uring, it is not allowed, or it
+	// cannot read yet (IORING_OP_READ came with Linux 5.6).
+	bool init(unsigned entries);
+	// Queues a read, submitting first when the queue is full.
+	bool read(int fd, void *buf, unsigned len, uint64_t data);
+	// Queues the cancellation of the request tagged target.
+	bool cancel(uint64_t target, uint64_t data);
+	// Submits what is queued and waits for at least one completion.
+	bool submitAndWait();
+	// io_uring_enter calls so far, any thread may ask
+	uint64_t entered() { return enters; }
+
+	// Calls fn(data, res) for each completion, res is read's return
+	// value or -errno.
+	template<typename F> void reap(F fn)
+	{
+		unsigned head = *cqHead;
+		unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+			uint64_t data = cqe->user_data;
+			int res = cqe->res;
+			// Released before fn, which may queue the next read.
+			__atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+			fn(data, res);
+			tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		}
+	}
+
+private:
+	bool enter(unsigned submit, unsigned wait);
+	bool canRead();
+	struct io_uring_sqe *next();
+	void push(struct io_uring_sqe *sqe);
+
+	int ringFd;
+	void *sqRing;
+	void *cqRing;
+	size_t sqRingSize;
+	size_t cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned sqEntries;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+	unsigned queued; // in the ring, not submitted yet
+	std::atomic<uint64_t> enters;
+};
+#endif
+
+#endif //OBS_SSP_SSP_URING_H
@@ -31,8 +31,18 @@ struct os_process_pipe {
 	int pid;
 	FILE *file;
 	FILE *err_file;
+	FILE *write_file; /* child's stdin when opened with "rw" */
+	FILE *aux_file;   /* child's OS_PROCESS_PIPE_AUX_FD with "rwa" */
 };
 
+static void close_fds(int *fds)
+{
+	if (fds[0] != -1) {
+		close(fds[0]);
+		close(fds[1]);
+	}
+}
+
 os_process_pipe_t *os_process_pipe_create_internal(const char *bin, char **argv,
 						   const char *type)
 {
@@ -45,9 +55,13 @@ os_process_pipe_t *os_process_pipe_create_internal(const char *bin, char **argv,
 	}
 
 	process_pipe.read_pipe = *type == 'r';
+	bool duplex = process_pipe.read_pipe && type[1] == 'w';
+	bool aux = duplex && type[2] == 'a';
 
 	int mainfds[2] = {0};
 	int errfds[2] = {0};
+	int infds[2] = {-1, -1};
+	int auxfds[2] = {-1, -1};
 
 	if (pipe(mainfds) != 0) {
 		return NULL;
@@ -60,11 +74,23 @@ os_process_pipe_t *os_process_pipe_create_internal(const char *bin, char **argv,
 		return NULL;
 	}
 
+	if ((duplex && pipe(infds) != 0) || (aux && pipe(auxfds) != 0)) {
+		close(mainfds[0]);
+		close(mainfds[1]);
+		close(errfds[0]);
+		close(errfds[1]);
+		close_fds(infds);
+
+		return NULL;
+	}
+
 	if (posix_spawn_file_actions_init(&file_actions) != 0) {
 		close(mainfds[0]);
 		close(mainfds[1]);
 		close(errfds[0]);
 		close(errfds[1]);
+		close_fds(infds);
+		close_fds(auxfds);
 
 		return NULL;
 	}
@@ -73,6 +99,13 @@ os_process_pipe_t *os_process_pipe_create_internal(const char *bin, char **argv,
 	fcntl(mainfds[1], F_SETFD, FD_CLOEXEC);
 	fcntl(errfds[0], F_SETFD, FD_CLOEXEC);
 	fcntl(errfds[1], F_SETFD, FD_CLOEXEC);
+	if (duplex) {
+		fcntl(infds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(infds[1], F_SETFD, FD_CLOEXEC);
+		posix_spawn_file_actions_addclose(&file_actions, infds[1]);
+		posix_spawn_file_actions_adddup2(&file_actions, infds[0],
+						 STDIN_FILENO);
+	}
 
 	if (process_pipe.read_pipe) {
 		posix_spawn_file_actions_addclose(&file_actions, mainfds[0]);
@@ -92,6 +125,15 @@ os_process_pipe_t *os_process_pipe_create_internal(const char *bin, char **argv,
 	posix_spawn_file_actions_adddup2(&file_actions, errfds[1],
 					 STDERR_FILENO);
 
+	/* Done last, a pipe fd dup'ed above may itself be fd 3. */
+	if (aux) {
+		fcntl(auxfds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(auxfds[1], F_SETFD, FD_CLOEXEC);
+		posix_spawn_file_actions_addclose(&file_actions, auxfds[0]);
+		posix_spawn_file_actions_adddup2(&file_actions, auxfds[1],
+						 OS_PROCESS_PIPE_AUX_FD);
+	}
+
 	int pid;
 	int ret = posix_spawn(&pid, bin, &file_actions, NULL,
 			      (char *const *)argv, environ);
@@ -103,6 +145,8 @@ os_process_pipe_t *os_process_pipe_create_internal(const char *bin, char **argv,
 		close(mainfds[1]);
 		close(errfds[0]);
 		close(errfds[1]);
+		close_fds(infds);
+		close_fds(auxfds);
 
 		return NULL;
 	}
@@ -110,6 +154,16 @@ os_process_pipe_t *os_process_pipe_create_internal(const char *bin, char **argv,
 	close(errfds[1]);
 	process_pipe.err_file = fdopen(errfds[0], "r");
 
+	if (duplex) {
+		close(infds[0]);
+		process_pipe.write_file = fdopen(infds[1], "w");
+	}
+
+	if (aux) {
+		close(auxfds[1]);
+		process_pipe.aux_file = fdopen(auxfds[0], "r");
+	}
+
 	if (process_pipe.read_pipe) {
 		close(mainfds[1]);
 		process_pipe.file = fdopen(mainfds[0], "r");
@@ -152,9 +206,16 @@ int os_process_pipe_destroy(os_process_pipe_t *pp)
 		fclose(pp->file);
 		pp->file = NULL;
 
+		os_process_pipe_close_write(pp);
+
 		fclose(pp->err_file);
 		pp->err_file = NULL;
 
+		if (pp->aux_file) {
+			fclose(pp->aux_file);
+			pp->aux_file = NULL;
+		}
+
 		do {
 			ret = waitpid(pp->pid, &status, 0);
 		} while (ret == -1 && errno == EINTR);
@@ -189,23 +250,67 @@ size_t os_process_pipe_read_err(os_process_pipe_t *pp, uint8_t *data,
 	return fread(data, 1, len, pp->err_file);
 }
 
+size_t os_process_pipe_read_aux(os_process_pipe_t *pp, uint8_t *data,
+				size_t len)
+{
+	if (!pp || !pp->aux_file) {
+		return 0;
+	}
+
+	return fread(data, 1, len, pp->aux_file);
+}
+
+int os_process_pipe_get_fd(os_process_pipe_t *pp)
+{
+	if (!pp || !pp->read_pipe) {
+		return -1;
+	}
+	return fileno(pp->file);
+}
+
+int os_process_pipe_get_err_fd(os_process_pipe_t *pp)
+{
+	if (!pp) {
+		return -1;
+	}
+	return fileno(pp->err_file);
+}
+
+int os_process_pipe_get_aux_fd(os_process_pipe_t *pp)
+{
+	if (!pp || !pp->aux_file) {
+		return -1;
+	}
+	return fileno(pp->aux_file);
+}
+
 size_t os_process_pipe_write(os_process_pipe_t *pp, const uint8_t *data,
 			     size_t len)
 {
 	if (!pp) {
 		return 0;
 	}
-	if (pp->read_pipe) {
+	FILE *file = pp->read_pipe ? pp->write_file : pp->file;
+	if (!file) {
 		return 0;
 	}
 
 	size_t written = 0;
 	while (written < len) {
-		size_t ret = fwrite(data + written, 1, len - written, pp->file);
+		size_t ret = fwrite(data + written, 1, len - written, file);
 		if (!ret)
 			return written;
 
 		written += ret;
 	}
+	fflush(file);
 	return written;
 }
+
+void os_process_pipe_close_write(os_process_pipe_t *pp)
+{
+	if (pp && pp->write_file) {
+		fclose(pp->write_file);
+		pp->write_file = NULL;
+	}
+}
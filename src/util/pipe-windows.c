@@ -26,6 +26,8 @@ struct os_process_pipe {
 	bool read_pipe;
 	HANDLE handle;
 	HANDLE handle_err;
+	HANDLE handle_write; /* child's stdin when opened with "rw" */
+	HANDLE handle_aux;   /* second child output with "rwa" */
 	HANDLE process;
 };
 
@@ -43,12 +45,39 @@ static bool create_pipe(HANDLE *input, HANDLE *output)
 	return true;
 }
 
+/* Copy of our environment with OS_PROCESS_PIPE_AUX_ENV added, the child
+ * has no other way to learn the value of an inherited handle. */
+static wchar_t *create_aux_environment(HANDLE aux_handle)
+{
+	wchar_t *env = GetEnvironmentStringsW();
+	wchar_t var[64];
+	size_t len = 0;
+
+	if (!env) {
+		return NULL;
+	}
+	while (env[len]) {
+		len += wcslen(env + len) + 1;
+	}
+
+	int var_len = _snwprintf(var, 64, L"%hs=%llu", OS_PROCESS_PIPE_AUX_ENV,
+				 (unsigned long long)(uintptr_t)aux_handle);
+	wchar_t *block = bmalloc((len + var_len + 2) * sizeof(wchar_t));
+	memcpy(block, env, len * sizeof(wchar_t));
+	memcpy(block + len, var, (var_len + 1) * sizeof(wchar_t));
+	block[len + var_len + 1] = 0;
+
+	FreeEnvironmentStringsW(env);
+	return block;
+}
+
 static inline bool create_process(const char *cmd_line, HANDLE stdin_handle,
 				  HANDLE stdout_handle, HANDLE stderr_handle,
-				  HANDLE *process)
+				  HANDLE aux_handle, HANDLE *process)
 {
 	PROCESS_INFORMATION pi = {0};
 	wchar_t *cmd_line_w = NULL;
+	wchar_t *env = NULL;
 	STARTUPINFOW si = {0};
 	bool success = false;
 
@@ -62,11 +91,18 @@ static inline bool create_process(const char *cmd_line, HANDLE stdin_handle,
 #ifndef SHOW_SUBPROCESSES
 	flags = CREATE_NO_WINDOW;
 #endif
+	if (aux_handle) {
+		env = create_aux_environment(aux_handle);
+		if (!env) {
+			return false;
+		}
+		flags |= CREATE_UNICODE_ENVIRONMENT;
+	}
 
 	os_utf8_to_wcs_ptr(cmd_line, 0, &cmd_line_w);
 	if (cmd_line_w) {
 		success = !!CreateProcessW(NULL, cmd_line_w, NULL, NULL, true,
-					   flags, NULL, NULL, &si, &pi);
+					   flags, env, NULL, &si, &pi);
 
 		if (success) {
 			*process = pi.hProcess;
@@ -80,6 +116,7 @@ static inline bool create_process(const char *cmd_line, HANDLE stdin_handle,
 
 		bfree(cmd_line_w);
 	}
+	bfree(env);
 
 	return success;
 }
@@ -89,9 +126,13 @@ os_process_pipe_t *os_process_pipe_create(const char *cmd_line,
 {
 	os_process_pipe_t *pp = NULL;
 	bool read_pipe;
+	bool duplex;
+	bool aux;
 	HANDLE process;
 	HANDLE output;
 	HANDLE err_input, err_output;
+	HANDLE in_input = NULL, in_output = NULL;
+	HANDLE aux_input = NULL, aux_output = NULL;
 	HANDLE input;
 	bool success;
 
@@ -110,6 +151,30 @@ os_process_pipe_t *os_process_pipe_create(const char *cmd_line,
 	}
 
 	read_pipe = *type == 'r';
+	duplex = read_pipe && type[1] == 'w';
+	aux = duplex && type[2] == 'a';
+
+	if (duplex) {
+		if (!create_pipe(&in_input, &in_output)) {
+			goto error;
+		}
+		success = !!SetHandleInformation(in_output,
+						 HANDLE_FLAG_INHERIT, false);
+		if (!success) {
+			goto error;
+		}
+	}
+
+	if (aux) {
+		if (!create_pipe(&aux_input, &aux_output)) {
+			goto error;
+		}
+		success = !!SetHandleInformation(aux_input, HANDLE_FLAG_INHERIT,
+						 false);
+		if (!success) {
+			goto error;
+		}
+	}
 
 	success = !!SetHandleInformation(read_pipe ? input : output,
 					 HANDLE_FLAG_INHERIT, false);
@@ -122,9 +187,10 @@ os_process_pipe_t *os_process_pipe_create(const char *cmd_line,
 		goto error;
 	}
 
-	success = create_process(cmd_line, read_pipe ? NULL : input,
+	success = create_process(cmd_line,
+				 read_pipe ? (duplex ? in_input : NULL) : input,
 				 read_pipe ? output : NULL, err_output,
-				 &process);
+				 aux_output, &process);
 	if (!success) {
 		goto error;
 	}
@@ -135,14 +201,30 @@ os_process_pipe_t *os_process_pipe_create(const char *cmd_line,
 	pp->read_pipe = read_pipe;
 	pp->process = process;
 	pp->handle_err = err_input;
+	pp->handle_write = in_output;
+	pp->handle_aux = aux_input;
 
 	CloseHandle(read_pipe ? output : input);
 	CloseHandle(err_output);
+	if (duplex) {
+		CloseHandle(in_input);
+	}
+	if (aux) {
+		CloseHandle(aux_output);
+	}
 	return pp;
 
 error:
 	CloseHandle(output);
 	CloseHandle(input);
+	if (in_input) {
+		CloseHandle(in_input);
+		CloseHandle(in_output);
+	}
+	if (aux_input) {
+		CloseHandle(aux_input);
+		CloseHandle(aux_output);
+	}
 	return NULL;
 }
 
@@ -218,8 +300,12 @@ int os_process_pipe_destroy(os_process_pipe_t *pp)
 
 		CloseHandle(pp->handle);
 		CloseHandle(pp->handle_err);
+		os_process_pipe_close_write(pp);
 
 		WaitForSingleObject(pp->process, INFINITE);
+		if (pp->handle_aux) {
+			CloseHandle(pp->handle_aux);
+		}
 		if (GetExitCodeProcess(pp->process, &code))
 			ret = (int)code;
 
@@ -270,6 +356,44 @@ size_t os_process_pipe_read_err(os_process_pipe_t *pp, uint8_t *data,
 	return 0;
 }
 
+size_t os_process_pipe_read_aux(os_process_pipe_t *pp, uint8_t *data,
+				size_t len)
+{
+	DWORD bytes_read;
+	bool success;
+
+	if (!pp || !pp->handle_aux) {
+		return 0;
+	}
+
+	success =
+		!!ReadFile(pp->handle_aux, data, (DWORD)len, &bytes_read, NULL);
+	if (success && bytes_read) {
+		return bytes_read;
+	}
+
+	return 0;
+}
+
+/* Pipe handles cannot be polled with the rest, callers read them instead. */
+int os_process_pipe_get_fd(os_process_pipe_t *pp)
+{
+	UNUSED_PARAMETER(pp);
+	return -1;
+}
+
+int os_process_pipe_get_err_fd(os_process_pipe_t *pp)
+{
+	UNUSED_PARAMETER(pp);
+	return -1;
+}
+
+int os_process_pipe_get_aux_fd(os_process_pipe_t *pp)
+{
+	UNUSED_PARAMETER(pp);
+	return -1;
+}
+
 size_t os_process_pipe_write(os_process_pipe_t *pp, const uint8_t *data,
 			     size_t len)
 {
@@ -279,15 +403,23 @@ size_t os_process_pipe_write(os_process_pipe_t *pp, const uint8_t *data,
 	if (!pp) {
 		return 0;
 	}
-	if (pp->read_pipe) {
+	HANDLE handle = pp->read_pipe ? pp->handle_write : pp->handle;
+	if (!handle) {
 		return 0;
 	}
 
-	success =
-		!!WriteFile(pp->handle, data, (DWORD)len, &bytes_written, NULL);
+	success = !!WriteFile(handle, data, (DWORD)len, &bytes_written, NULL);
 	if (success && bytes_written) {
 		return bytes_written;
 	}
 
 	return 0;
 }
+
+void os_process_pipe_close_write(os_process_pipe_t *pp)
+{
+	if (pp && pp->handle_write) {
+		CloseHandle(pp->handle_write);
+		pp->handle_write = NULL;
+	}
+}
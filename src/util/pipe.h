@@ -22,6 +22,9 @@
 extern "C" {
 #endif
 
+#define OS_PROCESS_PIPE_AUX_FD 3
+#define OS_PROCESS_PIPE_AUX_ENV "OS_PROCESS_PIPE_AUX"
+
 struct os_process_pipe;
 typedef struct os_process_pipe os_process_pipe_t;
 
@@ -40,6 +43,19 @@ EXPORT size_t os_process_pipe_read_err(os_process_pipe_t *pp, uint8_t *data,
 				       size_t len);
 EXPORT size_t os_process_pipe_write(os_process_pipe_t *pp, const uint8_t *data,
 				    size_t len);
+/* Signal EOF on the child's stdin of a pipe opened with "rw". */
+EXPORT void os_process_pipe_close_write(os_process_pipe_t *pp);
+/* Second output of the child for a pipe opened with "rwa": fd
+ * OS_PROCESS_PIPE_AUX_FD on POSIX, on Windows an inherited handle whose value
+ * is in the OS_PROCESS_PIPE_AUX_ENV environment variable. */
+EXPORT size_t os_process_pipe_read_aux(os_process_pipe_t *pp, uint8_t *data,
+				       size_t len);
+/* Descriptors of the child's stdout, stderr and aux output for polling,
+ * POSIX only. -1 on Windows or when the pipe has no such output. Do not
+ * mix with the read functions above, those go through stdio buffers. */
+EXPORT int os_process_pipe_get_fd(os_process_pipe_t *pp);
+EXPORT int os_process_pipe_get_err_fd(os_process_pipe_t *pp);
+EXPORT int os_process_pipe_get_aux_fd(os_process_pipe_t *pp);
 
 EXPORT struct os_process_args *os_process_args_create(const char *executable);
 EXPORT void os_process_args_add_arg(struct os_process_args *args,
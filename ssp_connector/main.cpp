@@ -29,11 +29,24 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <string>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
 
 #ifdef _WIN32
 #include <io.h>
 #include <fcntl.h>
+#else
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
 #endif
 
 #include <imf/ssp/sspclient.h>
@@ -41,32 +54,136 @@
 
 #include "main.h"
 #include "ssp_connector_proto.h"
+#include "ssp_nal_index.h"
+#include "ssp_shm_ring.h"
+#include "ssp_async_writer.h"
 
 char address[256] = {0};
 unsigned int port = 0;
 char uuid[64] = {0};
+char shm_name[SSP_SHM_NAME_MAX] = {0};
+unsigned int stream_style = 0;
+bool mux = false;
+bool control = false;
+bool aux = false;
+size_t write_budget = SSP_WRITER_DEFAULT_BUDGET;
+
+struct Session {
+	uint32_t stream;
+	std::string host;
+	unsigned int port;
+	imf::SspClient *client;
+	bool closing;
+
+	// set by commands, read by the callbacks; both run on the main thread
+	bool paused;
+	bool drop_non_idr;
+	bool wait_idr;
+	uint32_t queue_depth;
+	bool shedding; // backpressure, IDR frames only
+	bool hevc; // from the meta, for the NAL index
+	ConnectorStats stats;
+};
+
+struct Command {
+	uint32_t type;
+	uint32_t stream;
+	union {
+		SessionCmd session;
+		ControlCmd control;
+	} body;
+};
 
-imf::SspClient *gSspClient = nullptr;
 imf::Loop *gLoop = nullptr;
+SspShmRing *gShm = nullptr;
+SspAsyncWriter *gWriter = nullptr;
+SspAsyncWriter *gAuxWriter = nullptr; // --aux, audio and replies
+std::map<uint32_t, Session *> gSessions;
+bool gRunning = true;
 
-int msg_write(char *buf, size_t size)
+std::mutex gCommandLock;
+std::condition_variable gCommandCond;
+std::deque<Command> gCommands;
+bool gCommandEof = false;
+
+auto gStartTime = std::chrono::steady_clock::now();
+
+/*
+ * Gather write of a batch of messages to fd, only called on the writer
+ * threads. Short writes are resumed from where the pipe stopped, iov is
+ * modified in place.
+ */
+int msg_writev(int fd, struct iovec *iov, int cnt)
 {
-	Message *msg = (Message *)buf;
-	size_t writed = 0, cur = 0;
-	//log_conn("send msg type: %d, size %d", msg->type, msg->length);
-	writed = fwrite(buf, 1, size, stdout);
-	fflush(stdout);
-	if (ferror(stdout)) {
-		log_conn("ferror on msg_write");
-		return -1;
+	size_t writed = 0;
+	while (cnt > 0) {
+#ifdef _WIN32
+		int ret = _write(fd, iov->iov_base, (unsigned int)iov->iov_len);
+#else
+		ssize_t ret =
+			writev(fd, iov, cnt > IOV_MAX ? IOV_MAX : cnt);
+#endif
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_conn("write error on msg_writev: %d", errno);
+			return -1;
+		}
+		writed += (size_t)ret;
+
+		size_t n = (size_t)ret;
+		while (cnt > 0 && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			++iov;
+			--cnt;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
 	}
-	return writed;
+	return (int)writed;
+}
+
+/*
+ * Control, meta and doorbell messages: small and never dropped, waits for the
+ * writer if its queue is full. Returns -1 once the pipe is broken.
+ */
+int msg_write(char *buf, size_t size)
+{
+	struct iovec iov = {buf, size};
+	//log_conn("send msg type: %d, size %d", ((Message *)buf)->type, ((Message *)buf)->length);
+	return gWriter->push(&iov, 1, true) ? (int)size : -1;
+}
+
+// Replies that need not be ordered with video, on the aux pipe if there is one.
+int msg_write_aux(char *buf, size_t size)
+{
+	struct iovec iov = {buf, size};
+	auto writer = gAuxWriter ? gAuxWriter : gWriter;
+	return writer->push(&iov, 1, true) ? (int)size : -1;
 }
 
 int process_args(int argc, char **argv)
 {
 	int t = 1;
 	while (t < argc) {
+		if (!strcmp(argv[t], "-m") || !strcmp(argv[t], "--mux")) {
+			mux = true;
+			++t;
+			continue;
+		}
+		if (!strcmp(argv[t], "-c") || !strcmp(argv[t], "--control")) {
+			control = true;
+			++t;
+			continue;
+		}
+		if (!strcmp(argv[t], "-a") || !strcmp(argv[t], "--aux")) {
+			aux = true;
+			++t;
+			continue;
+		}
 		if (t + 1 >= argc) {
 			return -1;
 		}
@@ -81,6 +198,16 @@ int process_args(int argc, char **argv)
 			   !strcmp(argv[t], "--uuid")) {
 			++t;
 			strncpy(uuid, argv[t], sizeof(uuid));
+		} else if (!strcmp(argv[t], "-s") ||
+			   !strcmp(argv[t], "--shm")) {
+			++t;
+			strncpy(shm_name, argv[t], sizeof(shm_name) - 1);
+		} else if (!strcmp(argv[t], "--style")) {
+			++t;
+			stream_style = strtoul(argv[t], NULL, 0);
+		} else if (!strcmp(argv[t], "--write-budget")) {
+			++t;
+			write_budget = strtoul(argv[t], NULL, 0);
 		} else {
 			return -1;
 		}
@@ -88,7 +215,7 @@ int process_args(int argc, char **argv)
 		++t;
 	}
 
-	if (strlen(address) == 0 || port == 0) {
+	if (!mux && (strlen(address) == 0 || port == 0)) {
 		return -1;
 	}
 	return 0;
@@ -97,71 +224,292 @@ int process_args(int argc, char **argv)
 void print_usage(void)
 {
 	fprintf(stderr,
-		"Usage: ssp_connector --host host --port port [--uuid uuid]");
+		"Usage: ssp_connector --host host --port port [--uuid uuid] [--shm name]\n"
+		"                     [--style stream_style] [--control]\n"
+		"                     [--write-budget bytes] [--aux]\n"
+		"       ssp_connector --mux [--shm name] [--write-budget bytes]\n"
+		"                           [--aux]");
+}
+
+// CPU time and context switches of the whole process, to compare one
+// connector per camera against a --mux connector serving all of them.
+static void log_usage(void)
+{
+	double uptime = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - gStartTime)
+				.count();
+#ifdef _WIN32
+	FILETIME create_time, exit_time, kernel_time, user_time;
+	if (!GetProcessTimes(GetCurrentProcess(), &create_time, &exit_time,
+			     &kernel_time, &user_time)) {
+		return;
+	}
+	auto seconds = [](const FILETIME &ft) {
+		return (double)(((uint64_t)ft.dwHighDateTime << 32) |
+				ft.dwLowDateTime) /
+		       10000000.0;
+	};
+	log_conn("usage: %zu sessions, uptime %.1fs, cpu user %.3fs sys %.3fs",
+		 gSessions.size(), uptime, seconds(user_time),
+		 seconds(kernel_time));
+#else
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0) {
+		return;
+	}
+	log_conn("usage: %zu sessions, uptime %.1fs, cpu user %.3fs sys %.3fs, "
+		 "ctx switches %ld voluntary %ld involuntary",
+		 gSessions.size(), uptime,
+		 ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+		 ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6, ru.ru_nvcsw,
+		 ru.ru_nivcsw);
+#endif
+	for (auto writer : {gWriter, gAuxWriter}) {
+		if (!writer) {
+			continue;
+		}
+		log_conn("%s writer: %zu of %zu bytes queued, high water %llu, "
+			 "%llu messages dropped",
+			 writer == gWriter ? "main" : "aux", writer->backlog(),
+			 writer->budget(),
+			 (unsigned long long)writer->getHighWater(),
+			 (unsigned long long)writer->getDropped());
+	}
+}
+
+// The plugin side of the pipe is gone, shut the whole process down.
+static void stop_connector(void)
+{
+	gRunning = false;
+	gLoop->quit();
+}
+
+/*
+ * Queue a command for the main thread. The loop is left so the command runs
+ * between two loop iterations, sessions are only created and destroyed there.
+ * Loop::quit is safe to call from other threads, ThreadLoop relies on it too.
+ */
+static void post_command(const Command &cmd)
+{
+	{
+		std::lock_guard<std::mutex> lock(gCommandLock);
+		gCommands.push_back(cmd);
+	}
+	gCommandCond.notify_one();
+	gLoop->quit();
+}
+
+// Returns false when the session is already on its way out.
+static bool begin_close(uint32_t stream)
+{
+	auto it = gSessions.find(stream);
+	if (it == gSessions.end() || it->second->closing) {
+		return false;
+	}
+	it->second->closing = true;
+	return true;
+}
+
+static void close_session(uint32_t stream)
+{
+	if (!mux) {
+		stop_connector();
+		return;
+	}
+	Command cmd = {};
+	cmd.type = RemoveSessionCmd;
+	cmd.stream = stream;
+	post_command(cmd);
 }
 
-static void on_general_message(MessageType type)
+static void on_general_message(uint32_t stream, MessageType type)
 {
 	Message msg;
 	msg.length = 0;
 	msg.type = type;
+	msg.stream = stream;
 	int sz = msg_write((char *)&msg, sizeof(msg));
 	if (sz != sizeof(msg)) {
 		log_conn("stopped.");
-		//gSspClient->stop();
-		gLoop->quit();
+		stop_connector();
 	}
 }
 
-static void on_video(imf::SspH264Data *video)
+/*
+ * Store a Message record in the shared memory ring and ring the doorbell on
+ * the pipe. Returns false when the ring is not in use or full, the caller
+ * then sends the message inline.
+ */
+static bool shm_write(uint32_t stream, uint32_t type, const void *head,
+		      size_t head_len, const void *payload, size_t payload_len)
 {
-	size_t len = sizeof(Message) + sizeof(VideoData) + video->len;
-	auto *msg = (Message *)malloc(len);
-	msg->type = VideoDataMsg;
-	msg->length = sizeof(VideoData) + video->len;
-	auto *videoData = (VideoData *)msg->value;
-	videoData->frm_no = video->frm_no;
-	videoData->ntp_timestamp = video->ntp_timestamp;
-	videoData->pts = video->pts;
-	videoData->type = video->type;
-	videoData->len = video->len;
-	memcpy(videoData->data, video->data, video->len);
-	int sz = msg_write((char *)msg, len);
-	free(msg);
-	if (sz != len) {
+	if (!gShm) {
+		return false;
+	}
+	size_t len = sizeof(Message) + head_len + payload_len;
+	uint64_t pos = 0;
+	auto *rec = (Message *)gShm->reserve(len, &pos);
+	if (!rec) {
+		return false;
+	}
+	rec->type = type;
+	rec->length = (uint32_t)(head_len + payload_len);
+	rec->stream = stream;
+	memcpy(rec->value, head, head_len);
+	memcpy(rec->value + head_len, payload, payload_len);
+	gShm->commit(pos, len);
+
+	struct {
+		Message msg;
+		ShmDoorbell bell;
+	} doorbell;
+	doorbell.msg.type = ShmDataMsg;
+	doorbell.msg.length = sizeof(ShmDoorbell);
+	doorbell.msg.stream = stream;
+	doorbell.bell.pos = pos;
+	doorbell.bell.length = (uint32_t)len;
+	int sz = msg_write((char *)&doorbell, sizeof(doorbell));
+	if (sz != sizeof(doorbell)) {
 		log_conn("stopped.");
-		//gSspClient->stop();
-		gLoop->quit();
+		stop_connector();
 	}
+	return true;
 }
 
-static void on_audio(imf::SspAudioData *audio)
+/*
+ * Pause, IDR-only and backpressure filtering, type 5 is an IDR frame.
+ * A P-frame is only useful if everything since the last IDR got through,
+ * so once one is shed the rest of the GOP goes too. Past half of the writer
+ * budget only IDRs are queued, which keeps room for the next one.
+ */
+static bool forward_video(Session *session, imf::SspH264Data *video)
 {
-	size_t len = sizeof(Message) + sizeof(AudioData) + audio->len;
-	auto *msg = (Message *)malloc(len);
-	msg->type = AudioDataMsg;
-	msg->length = sizeof(AudioData) + audio->len;
-	auto *audioData = (AudioData *)msg->value;
-	audioData->ntp_timestamp = audio->ntp_timestamp;
-	audioData->pts = audio->pts;
-	audioData->len = audio->len;
-	memcpy(audioData->data, audio->data, audio->len);
+	bool idr = video->type == 5;
+	if (session->paused || (session->wait_idr && !idr) ||
+	    (session->drop_non_idr && !idr)) {
+		session->stats.video_dropped++;
+		return false;
+	}
+	session->wait_idr = false;
 
-	int sz = msg_write((char *)msg, len);
-	free(msg);
-	if (sz != len) {
+	// The plugin only reports crossing HIGH or LOW
+	bool congested = session->queue_depth >= SSP_QUEUE_DEPTH_HIGH;
+	if (gWriter->backlog() >= gWriter->budget() / 2) {
+		session->stats.writer_full++;
+		congested = true;
+	}
+	if (congested) {
+		session->shedding = true;
+	}
+	if (session->shedding) {
+		if (!idr) {
+			session->stats.video_shed++;
+			return false;
+		}
+		if (!congested) {
+			session->shedding = false;
+		}
+	}
+	return true;
+}
+
+// libssp could not keep up with the camera, lighten the rest of the GOP.
+static void on_buffer_full(Session *session)
+{
+	session->stats.recv_buffer_full++;
+	session->shedding = true;
+
+	Message msg;
+	msg.length = 0;
+	msg.type = RecvBufferFullMsg;
+	msg.stream = session->stream;
+	if (msg_write_aux((char *)&msg, sizeof(msg)) != sizeof(msg)) {
+		log_conn("stopped.");
+		stop_connector();
+	}
+}
+
+static void on_video(Session *session, imf::SspH264Data *video)
+{
+	uint32_t stream = session->stream;
+	if (!forward_video(session, video)) {
+		return;
+	}
+
+	VideoData header;
+	header.frm_no = video->frm_no;
+	header.ntp_timestamp = video->ntp_timestamp;
+	header.pts = video->pts;
+	header.type = video->type;
+	ssp_nal_index(video->data, video->len, session->hevc, &header.index);
+	header.len = video->len;
+	if (!shm_write(stream, VideoDataMsg, &header, sizeof(header),
+		       video->data, video->len)) {
+		Message msg;
+		msg.type = VideoDataMsg;
+		msg.length = sizeof(VideoData) + video->len;
+		msg.stream = stream;
+		struct iovec iov[3] = {{&msg, sizeof(msg)},
+				       {&header, sizeof(header)},
+				       {video->data, video->len}};
+		if (!gWriter->push(iov, 3, false)) {
+			if (gWriter->isFailed()) {
+				log_conn("stopped.");
+				stop_connector();
+				return;
+			}
+			// No room even for this frame, wait for the next IDR.
+			session->stats.video_shed++;
+			session->stats.writer_full++;
+			session->shedding = true;
+			return;
+		}
+	}
+	session->stats.video_frames++;
+	session->stats.video_bytes += video->len;
+}
+
+static void on_audio(Session *session, imf::SspAudioData *audio)
+{
+	uint32_t stream = session->stream;
+	session->stats.audio_frames++;
+	session->stats.audio_bytes += audio->len;
+
+	AudioData header;
+	header.ntp_timestamp = audio->ntp_timestamp;
+	header.pts = audio->pts;
+	header.len = audio->len;
+	// The shm doorbells are ordered with video, audio takes its own pipe.
+	if (!gAuxWriter && shm_write(stream, AudioDataMsg, &header,
+				     sizeof(header), audio->data, audio->len)) {
+		return;
+	}
+
+	Message msg;
+	msg.type = AudioDataMsg;
+	msg.length = sizeof(AudioData) + audio->len;
+	msg.stream = stream;
+	struct iovec iov[3] = {{&msg, sizeof(msg)},
+			       {&header, sizeof(header)},
+			       {audio->data, audio->len}};
+	// Dropped audio shows up in the writer counters of log_usage.
+	auto writer = gAuxWriter ? gAuxWriter : gWriter;
+	if (!writer->push(iov, 3, false) && writer->isFailed()) {
 		log_conn("stopped.");
-		//gSspClient->stop();
-		gLoop->quit();
+		stop_connector();
 	}
 }
-static void on_meta(imf::SspVideoMeta *vmeta, struct imf::SspAudioMeta *ameta,
-		    struct imf::SspMeta *meta)
+static void on_meta(Session *session, imf::SspVideoMeta *vmeta,
+		    struct imf::SspAudioMeta *ameta, struct imf::SspMeta *meta)
 {
+	uint32_t stream = session->stream;
+	session->hevc = vmeta->encoder != VIDEO_ENCODER_H264;
+
 	size_t len = sizeof(Message) + sizeof(Metadata);
 	auto *msg = (Message *)malloc(len);
 	msg->type = MetaDataMsg;
 	msg->length = sizeof(Metadata);
+	msg->stream = stream;
 	auto *metadata = (Metadata *)msg->value;
 	metadata->ameta.bitrate = ameta->bitrate;
 	metadata->ameta.channel = ameta->channel;
@@ -186,61 +534,313 @@ static void on_meta(imf::SspVideoMeta *vmeta, struct imf::SspAudioMeta *ameta,
 	free(msg);
 	if (sz != len) {
 		log_conn("stopped sz != len %d != %d.", sz, len);
-		//gSspClient->stop();
-		gLoop->quit();
+		stop_connector();
 	}
 }
-static void on_exception(int code, const char *description)
+static void on_exception(uint32_t stream, int code, const char *description)
 {
 	size_t len =
 		sizeof(Message) + sizeof(Message) + strlen(description) + 1;
 	auto *msg = (Message *)malloc(len);
 	msg->type = ExceptionMsg;
 	msg->length = sizeof(Message) + strlen(description) + 1;
+	msg->stream = stream;
 	auto *errmsg = (Message *)msg->value;
 	errmsg->length = strlen(description) + 1;
 	errmsg->type = code;
+	errmsg->stream = stream;
 	strcpy((char *)errmsg->value, description);
 	int sz = msg_write((char *)msg, len);
 	free(msg);
 	if (sz != len) {
 		log_conn("exception error.");
+		stop_connector();
+		return;
 	}
-	//gSspClient->stop();
-	gLoop->quit();
+	if (!begin_close(stream)) {
+		return;
+	}
+	// Other sessions keep running, let the plugin reconnect this one.
+	if (mux) {
+		on_general_message(stream, DisconnectMsg);
+	}
+	close_session(stream);
 }
 
-static void setup(imf::Loop *loop)
+static void start_client(Session *session)
 {
-	auto client = new imf::SspClient(address, loop, 0x400000, port, 0);
+	using namespace std::placeholders;
+
+	uint32_t stream = session->stream;
+	auto client = new imf::SspClient(session->host, gLoop, 0x400000,
+					 session->port,
+					 session->stats.stream_style);
 	client->init();
-	gSspClient = client;
 
-	client->setOnH264DataCallback(on_video);
-	client->setOnMetaCallback(on_meta);
-	client->setOnAudioDataCallback(on_audio);
-	client->setOnExceptionCallback(on_exception);
+	client->setOnH264DataCallback(std::bind(on_video, session, _1));
+	client->setOnMetaCallback(std::bind(on_meta, session, _1, _2, _3));
+	client->setOnAudioDataCallback(std::bind(on_audio, session, _1));
+	client->setOnExceptionCallback(std::bind(on_exception, stream, _1, _2));
 	client->setOnConnectionConnectedCallback(
-		std::bind(on_general_message, ConnectionConnectedMsg));
-	client->setOnRecvBufferFullCallback(
-		std::bind(on_general_message, RecvBufferFullMsg));
+		std::bind(on_general_message, stream, ConnectionConnectedMsg));
+	client->setOnRecvBufferFullCallback(std::bind(on_buffer_full, session));
 	client->setOnDisconnectedCallback([=]() {
-		on_general_message(DisconnectMsg);
-		//client->stop();
-		loop->quit();
+		if (!begin_close(stream)) {
+			return;
+		}
+		on_general_message(stream, DisconnectMsg);
+		close_session(stream);
 	});
 	client->start();
+	session->client = client;
+}
+
+static void stop_client(Session *session)
+{
+	// A disconnect reported while stopping is ours, not the camera's.
+	session->closing = true;
+	session->client->stop();
+	delete session->client;
+	session->client = nullptr;
+}
+
+static void add_session(uint32_t stream, const char *host,
+			unsigned int host_port, unsigned int style)
+{
+	if (gSessions.count(stream)) {
+		log_conn("session %u already exists", stream);
+		return;
+	}
+	auto session = new Session();
+	session->stream = stream;
+	session->host = host;
+	session->port = host_port;
+	session->stats.stream_style = style;
+	start_client(session);
+
+	gSessions[stream] = session;
+	log_conn("session %u: %s:%u style %u", stream, host, host_port, style);
+}
+
+static void remove_session(uint32_t stream)
+{
+	auto it = gSessions.find(stream);
+	if (it == gSessions.end()) {
+		return;
+	}
+	Session *session = it->second;
+	gSessions.erase(it);
+	stop_client(session);
+	delete session;
+	log_conn("session %u removed", stream);
+}
+
+// Reconnect to the camera with another stream, the pipe stays up.
+static void set_stream_style(Session *session, unsigned int style)
+{
+	if (session->stats.stream_style == style || session->closing) {
+		return;
+	}
+	log_conn("session %u: stream style %u -> %u", session->stream,
+		 session->stats.stream_style, style);
+	stop_client(session);
+	session->closing = false;
+	session->stats.stream_style = style;
+	session->wait_idr = true;
+	start_client(session);
+}
+
+static void send_stats(Session *session)
+{
+	struct {
+		Message msg;
+		ConnectorStats stats;
+	} reply;
+	reply.msg.type = StatsMsg;
+	reply.msg.length = sizeof(ConnectorStats);
+	reply.msg.stream = session->stream;
+	reply.stats = session->stats;
+	reply.stats.paused = session->paused;
+	reply.stats.drop_non_idr = session->drop_non_idr;
+	int sz = msg_write_aux((char *)&reply, sizeof(reply));
+	if (sz != sizeof(reply)) {
+		log_conn("stopped.");
+		stop_connector();
+	}
+}
 
+static void send_ok(void)
+{
 	Message msg;
 	msg.length = 0;
 	msg.type = ConnectorOkMsg;
+	msg.stream = 0;
 	int sz = msg_write((char *)&msg, sizeof(msg));
 
 	if (sz != sizeof(msg)) {
 		log_conn("stopped.");
-		//client->stop();
-		gLoop->quit();
+		stop_connector();
+	}
+}
+
+static void setup(imf::Loop *loop)
+{
+	(void)loop;
+	add_session(0, address, port, stream_style);
+	send_ok();
+}
+
+static bool read_full(void *buf, size_t size)
+{
+	size_t pos = 0;
+	while (pos < size) {
+#ifdef _WIN32
+		int ret = _read(_fileno(stdin), (uint8_t *)buf + pos,
+				(unsigned int)(size - pos));
+#else
+		ssize_t ret = read(STDIN_FILENO, (uint8_t *)buf + pos,
+				   size - pos);
+#endif
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			return false;
+		}
+		pos += (size_t)ret;
+	}
+	return true;
+}
+
+// Reads session commands from stdin, EOF means the plugin is done with us.
+static void command_reader(void)
+{
+	while (true) {
+		Message msg;
+		Command cmd = {};
+		if (!read_full(&msg, sizeof(msg))) {
+			break;
+		}
+		if (msg.length > sizeof(cmd.body)) {
+			log_conn("command %u too large: %u", msg.type,
+				 msg.length);
+			break;
+		}
+		if (msg.length && !read_full(&cmd.body, msg.length)) {
+			break;
+		}
+		cmd.type = msg.type;
+		cmd.stream = msg.stream;
+		cmd.body.session.host[sizeof(cmd.body.session.host) - 1] = '\0';
+		post_command(cmd);
+	}
+	log_conn("command pipe closed");
+	{
+		std::lock_guard<std::mutex> lock(gCommandLock);
+		gCommandEof = true;
+	}
+	gCommandCond.notify_one();
+	gLoop->quit();
+}
+
+static void run_commands(void)
+{
+	std::deque<Command> cmds;
+	{
+		std::lock_guard<std::mutex> lock(gCommandLock);
+		cmds.swap(gCommands);
+		if (gCommandEof) {
+			gRunning = false;
+		}
+	}
+	size_t sessions = gSessions.size();
+	for (auto &cmd : cmds) {
+		if (cmd.type == AddSessionCmd) {
+			add_session(cmd.stream, cmd.body.session.host,
+				    cmd.body.session.port,
+				    cmd.body.session.stream_style);
+			continue;
+		}
+		if (cmd.type == RemoveSessionCmd) {
+			remove_session(cmd.stream);
+			continue;
+		}
+
+		auto it = gSessions.find(cmd.stream);
+		if (it == gSessions.end()) {
+			continue;
+		}
+		Session *session = it->second;
+		switch (cmd.type) {
+		case PauseVideoCmd:
+			session->paused = true;
+			break;
+		case ResumeVideoCmd:
+			session->paused = false;
+			session->wait_idr = true;
+			break;
+		case SetStreamStyleCmd:
+			set_stream_style(session, cmd.body.control.value);
+			break;
+		case DropNonIdrCmd:
+			session->drop_non_idr = cmd.body.control.value != 0;
+			break;
+		case StatsCmd:
+			send_stats(session);
+			break;
+		case QueueDepthCmd:
+			session->queue_depth = cmd.body.control.value;
+			break;
+		default:
+			log_conn("unknown command %u", cmd.type);
+			break;
+		}
+	}
+	if (sessions != gSessions.size()) {
+		log_usage();
+	}
+}
+
+/*
+ * One loop serving every session. Commands are applied while the loop is not
+ * running; with no sessions there is nothing to run the loop for, so wait on
+ * the command queue instead.
+ */
+static void run_loop(imf::Loop *loop)
+{
+	while (gRunning) {
+		if (gSessions.empty()) {
+			std::unique_lock<std::mutex> lock(gCommandLock);
+			gCommandCond.wait(lock, [] {
+				return !gCommands.empty() || gCommandEof;
+			});
+		} else {
+			loop->loop();
+		}
+		run_commands();
+	}
+}
+
+// The second output set up by os_process_pipe_create with "rwa".
+static int open_aux(void)
+{
+#ifdef _WIN32
+	const char *value = getenv(SSP_AUX_ENV);
+	if (!value) {
+		return -1;
+	}
+	auto handle = (intptr_t)strtoull(value, NULL, 10);
+	int fd = _open_osfhandle(handle, 0);
+	if (fd >= 0) {
+		_setmode(fd, O_BINARY);
+	}
+	return fd;
+#else
+	if (fcntl(SSP_AUX_FD, F_GETFD) == -1) {
+		return -1;
 	}
+	return SSP_AUX_FD;
+#endif
 }
 
 int main(int argc, char **argv)
@@ -252,22 +852,67 @@ int main(int argc, char **argv)
 	}
 #ifdef _WIN32
 	_setmode(_fileno(stdout), O_BINARY);
+	_setmode(_fileno(stdin), O_BINARY);
 #endif
 	setvbuf(stdout, NULL, _IONBF, 0);
 	setvbuf(logfile, NULL, _IONBF, 0);
 	//setbuf(stdout, nullptr); // unbuffered stdout
 
-	log_conn("host: %s\nport: %d\nuuid: %s\n", address, port, uuid);
+	if (mux) {
+		log_conn("mux mode\nuuid: %s\n", uuid);
+	} else {
+		log_conn("host: %s\nport: %d\nuuid: %s\n", address, port, uuid);
+	}
+	if (strlen(shm_name) > 0) {
+		gShm = SspShmRing::open(shm_name);
+		if (gShm) {
+			log_conn("shm ring %s mapped, %zu bytes", shm_name,
+				 gShm->capacity());
+		} else {
+			log_conn("cannot map shm ring %s, using pipe only",
+				 shm_name);
+		}
+	}
 	auto loop = new imf::Loop();
 	loop->init();
 	gLoop = loop;
-	setup(gLoop);
-	loop->loop();
+#ifdef _WIN32
+	int out_fd = _fileno(stdout);
+#else
+	int out_fd = STDOUT_FILENO;
+#endif
+	gWriter = new SspAsyncWriter(write_budget,
+				     [out_fd](iovec *iov, int cnt) {
+					     return msg_writev(out_fd, iov, cnt);
+				     });
+	gWriter->start();
+	if (aux) {
+		int aux_fd = open_aux();
+		if (aux_fd >= 0) {
+			gAuxWriter = new SspAsyncWriter(
+				SSP_AUX_WRITER_BUDGET,
+				[aux_fd](iovec *iov, int cnt) {
+					return msg_writev(aux_fd, iov, cnt);
+				});
+			gAuxWriter->start();
+		} else {
+			log_conn("no aux pipe, sending everything on stdout");
+		}
+	}
+	if (mux || control) {
+		std::thread(command_reader).detach();
+	}
+	if (mux) {
+		send_ok();
+	} else {
+		setup(gLoop);
+	}
+	run_loop(gLoop);
 	log_conn("loop finished");
-	// gSspClient->stop();
+	log_usage();
+	delete gAuxWriter;
+	delete gWriter;
 	delete loop;
-	// if (gSspClient) {
-	// 	delete gSspClient;
-	// }
+	delete gShm;
 	return 0;
 }
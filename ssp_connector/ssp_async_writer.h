@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2015-2022, Yibai Zhang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ * 3.  Neither the name of Yibai Zhang, obs-ssp, ssp_connector
+ *     nor the names contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SSP_ASYNC_WRITER_H_
+#define SSP_ASYNC_WRITER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#include <limits.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+#define SSP_WRITER_DEFAULT_BUDGET (16 * 1024 * 1024)
+#define SSP_WRITER_BATCH 16
+
+/*
+ * Moves pipe writes off the loop thread. The loop thread copies each
+ * message into a single producer / single consumer byte ring, the writer
+ * thread hands whole batches of messages to writev.
+ *
+ * The ring size is the byte budget. Records never wrap, the producer leaves
+ * a skip record at the end of the ring instead, like SspShmRing. A push
+ * that does not fit fails right away unless it is marked as must-deliver,
+ * in which case it waits for the writer. Only small control messages are
+ * pushed that way, so the loop never waits behind video.
+ */
+class SspAsyncWriter {
+public:
+	typedef std::function<int(struct iovec *iov, int cnt)> WriteFunc;
+
+	SspAsyncWriter(size_t budget, const WriteFunc &write)
+		: writeFunc(write)
+	{
+		size = 4096;
+		while (size < budget) {
+			size <<= 1;
+		}
+		data = (uint8_t *)malloc(size);
+		head = 0;
+		tail = 0;
+		stopping = false;
+		failed = false;
+		consumerWaiting = false;
+		producerWaiting = false;
+		dropped = 0;
+		highWater = 0;
+	}
+
+	~SspAsyncWriter()
+	{
+		stop();
+		free(data);
+	}
+
+	void start() { thread = std::thread(&SspAsyncWriter::run, this); }
+
+	// Write out what is queued, then end the writer thread.
+	void stop()
+	{
+		if (!thread.joinable()) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		dataCond.notify_one();
+		thread.join();
+	}
+
+	/*
+	 * Queue one message made of cnt segments. Returns false when it was
+	 * dropped: no room and !must, or the pipe is gone (see isFailed).
+	 */
+	bool push(const struct iovec *iov, int cnt, bool must)
+	{
+		size_t len = 0;
+		for (int i = 0; i < cnt; ++i) {
+			len += iov[i].iov_len;
+		}
+		uint64_t need = align(sizeof(Record) + len);
+		if (need > size) {
+			dropped++;
+			return false;
+		}
+
+		uint64_t pos, pad;
+		while (true) {
+			if (failed) {
+				return false;
+			}
+			uint64_t h = head.load(std::memory_order_relaxed);
+			uint64_t t = tail.load(std::memory_order_acquire);
+			uint64_t off = h & (size - 1);
+			pad = off + need > size ? size - off : 0;
+			if (h + pad + need - t <= size) {
+				pos = h;
+				break;
+			}
+			if (!must) {
+				dropped++;
+				return false;
+			}
+			waitForSpace();
+		}
+
+		if (pad) {
+			auto skip = (Record *)(data + (pos & (size - 1)));
+			skip->len = 0;
+			skip->skip = 1;
+			pos += pad;
+		}
+		auto rec = (Record *)(data + (pos & (size - 1)));
+		rec->len = (uint32_t)len;
+		rec->skip = 0;
+		uint8_t *dst = (uint8_t *)(rec + 1);
+		for (int i = 0; i < cnt; ++i) {
+			memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+			dst += iov[i].iov_len;
+		}
+		head.store(pos + need, std::memory_order_seq_cst);
+
+		uint64_t used =
+			pos + need - tail.load(std::memory_order_relaxed);
+		if (used > highWater) {
+			highWater = used;
+		}
+		if (consumerWaiting.load(std::memory_order_seq_cst)) {
+			std::lock_guard<std::mutex> lock(mutex);
+			dataCond.notify_one();
+		}
+		return true;
+	}
+
+	// Bytes queued and not yet written.
+	size_t backlog() const
+	{
+		return (size_t)(head.load(std::memory_order_relaxed) -
+				tail.load(std::memory_order_relaxed));
+	}
+	size_t budget() const { return size; }
+	bool isFailed() const { return failed; }
+	uint64_t getDropped() const { return dropped; }
+	uint64_t getHighWater() const { return highWater; }
+
+private:
+	struct Record {
+		uint32_t len;
+		uint32_t skip; // rest of the ring is padding
+	};
+
+	static uint64_t align(uint64_t len) { return (len + 7) & ~(uint64_t)7; }
+
+	void waitForSpace()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		producerWaiting = true;
+		spaceCond.wait_for(lock, std::chrono::milliseconds(10));
+		producerWaiting = false;
+	}
+
+	void run()
+	{
+		struct iovec iov[SSP_WRITER_BATCH];
+		while (true) {
+			uint64_t t = tail.load(std::memory_order_relaxed);
+			uint64_t h = head.load(std::memory_order_acquire);
+			if (t == h) {
+				consumerWaiting.store(true,
+						      std::memory_order_seq_cst);
+				if (head.load(std::memory_order_seq_cst) != t) {
+					consumerWaiting = false;
+					continue;
+				}
+				std::unique_lock<std::mutex> lock(mutex);
+				if (stopping) {
+					break;
+				}
+				dataCond.wait_for(
+					lock, std::chrono::milliseconds(100));
+				consumerWaiting = false;
+				continue;
+			}
+
+			int cnt = 0;
+			uint64_t pos = t;
+			while (pos < h && cnt < SSP_WRITER_BATCH) {
+				uint64_t off = pos & (size - 1);
+				auto rec = (Record *)(data + off);
+				if (rec->skip) {
+					pos += size - off;
+					continue;
+				}
+				iov[cnt].iov_base = rec + 1;
+				iov[cnt].iov_len = rec->len;
+				++cnt;
+				pos += align(sizeof(Record) + rec->len);
+			}
+			if (cnt && writeFunc(iov, cnt) < 0) {
+				failed = true;
+				std::lock_guard<std::mutex> lock(mutex);
+				spaceCond.notify_all();
+				break;
+			}
+			tail.store(pos, std::memory_order_release);
+			if (producerWaiting) {
+				std::lock_guard<std::mutex> lock(mutex);
+				spaceCond.notify_one();
+			}
+		}
+	}
+
+	WriteFunc writeFunc;
+	uint8_t *data;
+	uint64_t size;
+	alignas(64) std::atomic<uint64_t> head; // loop thread
+	alignas(64) std::atomic<uint64_t> tail; // writer thread
+
+	std::mutex mutex;
+	std::condition_variable dataCond;
+	std::condition_variable spaceCond;
+	std::atomic<bool> consumerWaiting;
+	std::atomic<bool> producerWaiting;
+	bool stopping;
+	std::atomic<bool> failed;
+
+	std::atomic<uint64_t> dropped;
+	std::atomic<uint64_t> highWater;
+	std::thread thread;
+};
+
+#endif
@@ -66,11 +66,35 @@ struct SSP_PROTO Metadata {
 	struct AudioMeta ameta;
 };
 
+/*
+ * Annex B layout of a video frame, filled in by the connector so the plugin
+ * need not scan the frame again, see ssp_nal_index.h. offset is where a NAL
+ * unit's header starts in VideoData::data, header is its first byte.
+ */
+#define SSP_NAL_INDEX_MAX 16
+#define SSP_NAL_INDEXED 0x01 // the index and the flags below are valid
+#define SSP_NAL_KEYFRAME 0x02 // IDR (H.264) or IRAP (HEVC) slices
+#define SSP_NAL_REFERENCE 0x04 // later frames may reference this one
+#define SSP_NAL_PARAM_SETS 0x08 // carries SPS and PPS (and VPS for HEVC)
+#define SSP_NAL_TRUNCATED 0x10 // more NAL units than nals holds
+
+struct SSP_PROTO NalUnit {
+	uint32_t offset;
+	uint8_t header;
+};
+
+struct SSP_PROTO NalIndex {
+	uint16_t flags;
+	uint16_t count;
+	struct NalUnit nals[SSP_NAL_INDEX_MAX];
+};
+
 struct SSP_PROTO VideoData {
 	uint64_t pts;
 	uint64_t ntp_timestamp;
 	uint32_t frm_no;
 	uint32_t type; // I or P
+	struct NalIndex index;
 	size_t len;
 	uint8_t data[0];
 };
@@ -82,6 +106,12 @@ struct SSP_PROTO AudioData {
 	uint8_t data[0];
 };
 
+// A Message record stored in the shared memory ring, see ssp_shm_ring.h
+struct SSP_PROTO ShmDoorbell {
+	uint64_t pos;
+	uint32_t length;
+};
+
 enum MessageType {
 	MetaDataMsg = 1,
 	VideoDataMsg,
@@ -91,11 +121,73 @@ enum MessageType {
 	ConnectionConnectedMsg,
 	ExceptionMsg,
 	ConnectorOkMsg,
+	ShmDataMsg,
+	StatsMsg,
+};
+
+// Reply to StatsCmd, counters since the session was added
+struct SSP_PROTO ConnectorStats {
+	uint64_t video_frames;
+	uint64_t video_bytes;
+	uint64_t video_dropped; // paused or IDR only
+	uint64_t video_shed; // backpressure
+	uint64_t audio_frames;
+	uint64_t audio_bytes;
+	uint32_t stream_style;
+	uint32_t paused;
+	uint32_t drop_non_idr;
+	uint32_t recv_buffer_full;
+	uint32_t writer_full; // frames seen over half the write budget
+};
+
+/*
+ * Plugin queue depth, in frames waiting for the decoder. The plugin reports
+ * it when it goes above HIGH or back down to LOW; in between the connector
+ * forwards IDR frames only and resumes at the first IDR after LOW.
+ */
+#define SSP_QUEUE_DEPTH_HIGH 4
+#define SSP_QUEUE_DEPTH_LOW 1
+
+/*
+ * With --aux, audio, stats and RecvBufferFull go on a second pipe the plugin
+ * reads on its own thread, so audio never waits behind a large video frame.
+ * Meta and connection state stay ordered with video on stdout. Same values
+ * as OS_PROCESS_PIPE_AUX_FD and OS_PROCESS_PIPE_AUX_ENV in util/pipe.h.
+ */
+#define SSP_AUX_FD 3
+#define SSP_AUX_ENV "OS_PROCESS_PIPE_AUX"
+#define SSP_AUX_WRITER_BUDGET (1024 * 1024)
+
+/*
+ * Commands written by the plugin to the connector's stdin, with --mux or
+ * --control. Message::stream selects the session.
+ */
+struct SSP_PROTO SessionCmd {
+	char host[256];
+	uint32_t port;
+	uint32_t stream_style;
+};
+
+struct SSP_PROTO ControlCmd {
+	uint32_t value;
+};
+
+enum CommandType {
+	AddSessionCmd = 0x100, // SessionCmd
+	RemoveSessionCmd,
+	PauseVideoCmd,
+	ResumeVideoCmd, // forwarding restarts at the next IDR
+	SetStreamStyleCmd, // ControlCmd, STREAM_DEFAULT/MAIN/SEC
+	DropNonIdrCmd, // ControlCmd, 1 to forward IDR frames only
+	StatsCmd, // answered with StatsMsg
+	QueueDepthCmd, // ControlCmd, frames queued in the plugin
 };
 
+// stream is 0 for a single-camera connector, the session id with --mux
 struct Message {
 	uint32_t type;
 	uint32_t length;
+	uint32_t stream;
 	uint8_t value[0];
 };
 
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2015-2023, Yibai Zhang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ * 3.  Neither the name of Yibai Zhang, obs-ssp, ssp_connector
+ *     nor the names contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SSP_NAL_INDEX_H_
+#define SSP_NAL_INDEX_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "ssp_connector_proto.h"
+
+// First byte after the next 00 00 01 start code from p on, or end.
+static inline const uint8_t *ssp_nal_next(const uint8_t *p,
+					  const uint8_t *end)
+{
+	while (end - p >= 3) {
+		auto *one = (const uint8_t *)memchr(p + 2, 1, end - p - 2);
+		if (!one) {
+			return end;
+		}
+		if (!one[-1] && !one[-2]) {
+			return one + 1;
+		}
+		p = one - 1;
+	}
+	return end;
+}
+
+/*
+ * Builds the NalIndex of an Annex B frame in one pass over it. The first
+ * slice decides about KEYFRAME and REFERENCE, the same way the plugin's
+ * own scans do: nal_ref_idc in H.264, the sub-layer non-reference types
+ * in HEVC. A frame without a slice counts as a reference.
+ */
+static inline void ssp_nal_index(const uint8_t *data, size_t len, bool hevc,
+				 struct NalIndex *index)
+{
+	const uint8_t *end = data + len;
+	uint32_t sets = 0;
+	bool slice = false;
+	index->flags = SSP_NAL_INDEXED;
+	index->count = 0;
+	for (const uint8_t *nal = ssp_nal_next(data, end); nal < end;
+	     nal = ssp_nal_next(nal, end)) {
+		uint8_t header = nal[0];
+		if (index->count < SSP_NAL_INDEX_MAX) {
+			index->nals[index->count].offset =
+				(uint32_t)(nal - data);
+			index->nals[index->count].header = header;
+			index->count++;
+		} else {
+			index->flags |= SSP_NAL_TRUNCATED;
+		}
+
+		if (hevc) {
+			uint8_t type = (header >> 1) & 0x3f;
+			if (type >= 32 && type <= 34) {
+				sets |= 1 << (type - 32); // VPS, SPS, PPS
+			} else if (type < 32 && !slice) {
+				slice = true;
+				if (type >= 16 && type <= 23) {
+					index->flags |= SSP_NAL_KEYFRAME;
+				}
+				if (type >= 16 || (type & 1)) {
+					index->flags |= SSP_NAL_REFERENCE;
+				}
+			}
+		} else {
+			uint8_t type = header & 0x1f;
+			if (type == 7 || type == 8) {
+				sets |= 1 << (type - 7); // SPS, PPS
+			} else if (type >= 1 && type <= 5 && !slice) {
+				slice = true;
+				if (type == 5) {
+					index->flags |= SSP_NAL_KEYFRAME;
+				}
+				if (header & 0x60) {
+					index->flags |= SSP_NAL_REFERENCE;
+				}
+			}
+		}
+	}
+	if (!slice) {
+		index->flags |= SSP_NAL_REFERENCE;
+	}
+	if (sets == (hevc ? 7u : 3u)) {
+		index->flags |= SSP_NAL_PARAM_SETS;
+	}
+}
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2015-2022, Yibai Zhang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ * 3.  Neither the name of Yibai Zhang, obs-ssp, ssp_connector
+ *     nor the names contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SSP_SHM_RING_H_
+#define SSP_SHM_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <atomic>
+#include <new>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Single producer / single consumer byte ring living in a named shared
+ * memory object. The plugin creates it, the connector maps it by name.
+ *
+ * Every record is a complete `Message` (header + body) stored contiguously
+ * at a 64 byte aligned position. Records never wrap: if one does not fit
+ * before the end of the data area the producer skips to the start. The
+ * position of each record is announced through a `ShmDataMsg` doorbell on
+ * the pipe, the consumer hands the record back with release() once the
+ * callbacks returned.
+ */
+
+#define SSP_SHM_MAGIC 0x52505353 // "SSPR"
+#define SSP_SHM_HEADER_SIZE 4096
+#define SSP_SHM_ALIGN 64
+#define SSP_SHM_DEFAULT_SIZE (32 * 1024 * 1024)
+#define SSP_SHM_NAME_MAX 64
+
+struct SspShmHeader {
+	uint32_t magic;
+	uint32_t header_size;
+	uint64_t size;
+	alignas(64) std::atomic<uint64_t> head; // written by the producer
+	alignas(64) std::atomic<uint64_t> tail; // written by the consumer
+};
+
+class SspShmRing {
+public:
+	// Create a new ring, size is rounded up to a power of two.
+	static SspShmRing *create(const char *name, size_t size)
+	{
+		size_t ring_size = SSP_SHM_ALIGN;
+		while (ring_size < size) {
+			ring_size <<= 1;
+		}
+		size_t total = SSP_SHM_HEADER_SIZE + ring_size;
+		void *handle = nullptr;
+		auto *base = (uint8_t *)map(name, total, true, &handle);
+		if (!base) {
+			return nullptr;
+		}
+		auto *hdr = new (base) SspShmHeader;
+		hdr->magic = SSP_SHM_MAGIC;
+		hdr->header_size = SSP_SHM_HEADER_SIZE;
+		hdr->size = ring_size;
+		hdr->head.store(0, std::memory_order_relaxed);
+		hdr->tail.store(0, std::memory_order_release);
+		return new SspShmRing(name, base, total, handle, true);
+	}
+
+	// Map a ring created by the other side.
+	static SspShmRing *open(const char *name)
+	{
+		void *handle = nullptr;
+		auto *base = (uint8_t *)map(name, SSP_SHM_HEADER_SIZE, false,
+					    &handle);
+		if (!base) {
+			return nullptr;
+		}
+		auto *hdr = (SspShmHeader *)base;
+		if (hdr->magic != SSP_SHM_MAGIC ||
+		    hdr->header_size != SSP_SHM_HEADER_SIZE) {
+			unmap(base, SSP_SHM_HEADER_SIZE, handle);
+			return nullptr;
+		}
+		size_t total = SSP_SHM_HEADER_SIZE + hdr->size;
+		unmap(base, SSP_SHM_HEADER_SIZE, handle);
+
+		base = (uint8_t *)map(name, total, false, &handle);
+		if (!base) {
+			return nullptr;
+		}
+		return new SspShmRing(name, base, total, handle, false);
+	}
+
+	~SspShmRing()
+	{
+		unmap(base, total, handle);
+		if (owner) {
+			unlink();
+		}
+	}
+
+	// Remove the name once the peer has mapped the ring.
+	void unlink()
+	{
+#ifndef _WIN32
+		if (!unlinked) {
+			shm_unlink(name);
+		}
+#endif
+		unlinked = true;
+	}
+
+	const char *getName() const { return name; }
+	size_t capacity() const { return (size_t)hdr->size; }
+
+	// Producer: find room for a record of len bytes. Returns nullptr
+	// when the consumer is too far behind, the caller falls back to the
+	// pipe in that case.
+	uint8_t *reserve(size_t len, uint64_t *pos)
+	{
+		uint64_t size = hdr->size;
+		uint64_t need = align(len);
+		uint64_t head = hdr->head.load(std::memory_order_relaxed);
+		uint64_t tail = hdr->tail.load(std::memory_order_acquire);
+		uint64_t off = head & (size - 1);
+		uint64_t start = head;
+
+		if (need > size) {
+			return nullptr;
+		}
+		if (off + need > size) {
+			start += size - off;
+		}
+		if (start + need - tail > size) {
+			return nullptr;
+		}
+		*pos = start;
+		return data + (start & (size - 1));
+	}
+
+	// Producer: publish the record written at pos.
+	void commit(uint64_t pos, size_t len)
+	{
+		hdr->head.store(pos + align(len), std::memory_order_release);
+	}
+
+	// Consumer: locate the record announced by a doorbell.
+	uint8_t *at(uint64_t pos, size_t len)
+	{
+		uint64_t size = hdr->size;
+		uint64_t head = hdr->head.load(std::memory_order_acquire);
+		uint64_t tail = hdr->tail.load(std::memory_order_relaxed);
+		if (pos < tail || pos + len > head ||
+		    (pos & (size - 1)) + len > size) {
+			return nullptr;
+		}
+		return data + (pos & (size - 1));
+	}
+
+	// Consumer: hand the record at pos back to the producer.
+	void release(uint64_t pos, size_t len)
+	{
+		hdr->tail.store(pos + align(len), std::memory_order_release);
+	}
+
+private:
+	SspShmRing(const char *ring_name, uint8_t *mem, size_t mem_size,
+		   void *map_handle, bool is_owner)
+		: hdr((SspShmHeader *)mem),
+		  base(mem),
+		  data(mem + SSP_SHM_HEADER_SIZE),
+		  total(mem_size),
+		  handle(map_handle),
+		  owner(is_owner),
+		  unlinked(false)
+	{
+		snprintf(name, sizeof(name), "%s", ring_name);
+	}
+
+	static uint64_t align(uint64_t len)
+	{
+		return (len + SSP_SHM_ALIGN - 1) & ~(uint64_t)(SSP_SHM_ALIGN - 1);
+	}
+
+	static void *map(const char *name, size_t size, bool create,
+			 void **handle)
+	{
+#ifdef _WIN32
+		HANDLE h;
+		if (create) {
+			h = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL,
+					       PAGE_READWRITE,
+					       (DWORD)((uint64_t)size >> 32),
+					       (DWORD)(size & 0xffffffff), name);
+		} else {
+			h = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+		}
+		if (!h) {
+			return nullptr;
+		}
+		void *mem = MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, size);
+		if (!mem) {
+			CloseHandle(h);
+			return nullptr;
+		}
+		*handle = h;
+		return mem;
+#else
+		int fd = shm_open(name, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR,
+				  0600);
+		if (fd < 0) {
+			return nullptr;
+		}
+		if (create && ftruncate(fd, (off_t)size) != 0) {
+			close(fd);
+			shm_unlink(name);
+			return nullptr;
+		}
+		void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED) {
+			if (create) {
+				shm_unlink(name);
+			}
+			return nullptr;
+		}
+		*handle = nullptr;
+		return mem;
+#endif
+	}
+
+	static void unmap(void *mem, size_t size, void *handle)
+	{
+#ifdef _WIN32
+		(void)size;
+		UnmapViewOfFile(mem);
+		CloseHandle((HANDLE)handle);
+#else
+		(void)handle;
+		munmap(mem, size);
+#endif
+	}
+
+	SspShmHeader *hdr;
+	uint8_t *base;
+	uint8_t *data;
+	size_t total;
+	void *handle;
+	bool owner;
+	bool unlinked;
+	char name[SSP_SHM_NAME_MAX];
+};
+
+#endif